@@ -1,9 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <CL/cl.h> // Include the OpenCL header for OpenCL functions and definitions
 #include <chrono>  // Include for measuring execution time
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <random>
+#include <type_traits>
+#include <math.h>
+#include <new>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+#include "vecops.h"
 
 #define PRINT 1  // Define a flag for conditional printing
+#define ELEMENTWISE_SOURCE_NAME "<elementwise ops>"  // Variant name of the generated kernels
+#define MEMORY_FRACTION 0.8    // Share of the free host or device memory a run may use
+#define STREAM_DEPTH 4         // Chunks in flight when main() streams
+#define MIN_STREAM_CHUNK 4096  // Smallest chunk worth streaming
 
 // Global variable to store vector size, with a default value
 int SZ = 100000000;
@@ -11,6 +42,18 @@ int SZ = 100000000;
 // Global pointers for vectors and their output
 int *v1, *v2, *v_out;
 
+// Allocation accounting: host allocations made through host_malloc() or
+// operator new (which also sees an OpenCL runtime's own C++ allocations),
+// and OpenCL objects created through the clCreate* entry points. Events
+// handed back by the enqueue calls are counted apart: cl_event_references
+// goes up on every event returned or retained and down on every release.
+std::atomic<long> host_allocations(0);
+std::atomic<long> cl_object_creations(0);
+std::atomic<long> cl_events_created(0);
+std::atomic<long> cl_event_references(0);
+std::atomic<long long> device_bytes(0);       // Bytes in live device buffers
+std::atomic<long long> device_bytes_peak(0);  // High-water mark of device_bytes
+
 // OpenCL objects for memory buffers, device, context, program, kernel, queue, and events
 cl_mem bufV1, bufV2, bufV_out;
 cl_device_id device_id;
@@ -19,17 +62,217 @@ cl_program program;
 cl_kernel kernel;
 cl_command_queue queue;
 cl_event event = NULL;
+cl_event bufV_out_migrated = NULL;  // Output migration queued by setup_kernel_memory()
 int err; // Error handling variable
 
 // Function declarations
 cl_device_id create_device();
 void setup_openCL_device_context_queue_kernel(const char *filename, const char *kernelname);
 cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename);
+cl_program build_program_with_options(cl_context ctx, cl_device_id dev, const char *filename, const char *options);
+char *read_source(const char *filename, size_t *size);
 void setup_kernel_memory();
 void copy_kernel_args();
 void free_memory();
 void init(int *&A, int size);
 void print(int *A, int size);
+void *host_malloc(size_t size);
+void check_error(int err, const char *message);
+void setup_openCL_device_context_queue();
+cl_kernel create_kernel(cl_program prog, const char *kernelname);
+
+// Layout conversion functions (host and device)
+void aos_to_soa(const int *aos, int n, int *x, int *y, int *z, int *w);
+void soa_to_aos(const int *x, const int *y, const int *z, const int *w, int n, int *aos);
+void transpose_blocked(const int *in, int rows, int cols, int *out);
+void setup_layout_kernels();
+void free_layout_kernels();
+void aos_to_soa_ocl(cl_mem aos, int n, cl_mem x, cl_mem y, cl_mem z, cl_mem w);
+void soa_to_aos_ocl(cl_mem x, cl_mem y, cl_mem z, cl_mem w, int n, cl_mem aos);
+void transpose_ocl(cl_mem in, int rows, int cols, cl_mem out);
+void run_layout();
+
+// Segmented reduction functions (host and device)
+void segmented_reduce_offsets(const int *values, const int *offsets, int num_segments, int op, int *result);
+int reduce_by_key(const int *keys, const int *values, int n, int op, int *keys_out, int *result);
+void setup_segmented_kernels();
+void free_segmented_kernels();
+void segmented_scan_ocl(cl_mem in, cl_mem flags, int n, int op, cl_mem out);
+void segmented_reduce_offsets_ocl(cl_mem values, int n, cl_mem offsets, int num_segments, int op, cl_mem result);
+int reduce_by_key_ocl(cl_mem keys, cl_mem values, int n, int op, cl_mem keys_out, cl_mem result);
+void run_segmented_reduce();
+
+// Top-k selection functions (host and device)
+void topk(const int *values, int n, int k, int *out_values, int *out_indices);
+void setup_topk_kernels();
+void free_topk_kernels();
+void topk_ocl(cl_mem values, int n, int k, cl_mem out_values, cl_mem out_indices);
+void run_topk(int k);
+
+// On-device checksums
+struct Checksum;
+unsigned int checksum_mix(unsigned int i, unsigned int v);
+Checksum checksum_host(const int *data, long n);
+Checksum checksum_add_host(const int *a, const int *b, long n);
+void setup_checksum_kernels();
+void free_checksum_kernels();
+Checksum checksum_run(cl_kernel k, int first_arg, int n);
+Checksum checksum_ocl(cl_mem data, int n);
+Checksum checksum_add_ocl(cl_mem a, cl_mem b, int n);
+void run_checksum();
+
+// Concurrent kernel variant compilation
+void start_variant_builds(int first);
+void build_variant_worker();
+cl_program compile_program(const char *filename, const char *options, char **log);
+int find_variant(const char *filename, const char *options);
+cl_program get_program(const char *filename, const char *options);
+bool variant_ready(int id);
+void join_variant_workers();
+void free_variants();
+
+// Resident server with kernel hot-reload
+void server_ensure_capacity(int size);
+void server_swap_kernel();
+void server_worker();
+bool server_submit(int size, const char *tenant_name, void (*done)(long, double, void *) = NULL, void *done_arg = NULL,
+                   double deadline_ms = 0, long *id = NULL);
+bool server_cancel(long id);
+void server_configure_tenant(const char *name, double weight, int priority);
+int server_tenant(const char *name);
+double percentile(double *values, long n, double p);
+void server_report();
+void reload_variant(const char *filename);
+void watch_kernel_sources();
+void run_server();
+void server_wait_idle();
+void server_start();
+void server_stop();
+void run_alloc_check();
+void run_loadgen(const char *loop, const char *levels, const char *dist, double seconds);
+bool server_wait_space(const char *tenant_name, int size);
+
+// Workload trace capture and replay
+struct Job;
+void trace_open();
+void trace_job(const Job &job, int completed, double service_ms, double latency_ms);
+void trace_close();
+void run_replay(const char *path, const char *pace);
+
+// Host backend and lazy OpenCL loading
+void vector_add_host(const int *a, const int *b, int *c, int size);
+void run_host();
+bool load_opencl();
+
+// Hardware performance counters for host phases
+void perf_begin(const char *phase);
+void perf_end();
+void perf_report();
+
+// Strong and weak scaling report
+void vector_add_threads(const int *a, const int *b, int *c, int size, int threads);
+double time_host_add(int size, int threads, int reps);
+int collect_scaling_devices(cl_device_id *devs, int max_units);
+double time_device_add(cl_command_queue *queues, cl_command_queue *migrate_queues, int units, int size, int reps,
+                       double *migrate_ms);
+void run_scaling(int max_threads);
+
+// Explain mode: predicted cost breakdown from a calibrated model
+void load_cost_model();
+void save_cost_model();
+double event_span_ms(cl_event first, cl_event last);
+void measure_add(cl_kernel k, int size, double *write_ms, double *kernel_ms, double *read_ms);
+double measure_latency(cl_kernel k);
+void update_cost_model(int variant, int size, double write_ms, double kernel_ms, double read_ms, double weight);
+int choose_add_variant();
+void print_plan(int size);
+void run_explain(const char *action);
+
+// On-device input generation
+void philox_fill(int *out, int n, unsigned long long seed, unsigned int stream, unsigned int range);
+void iota_fill(int *out, int n, int start);
+void setup_generate_kernels();
+void free_generate_kernels();
+void fill_ocl(cl_mem buf, int n, int value);
+void iota_ocl(cl_mem buf, int n, int start);
+void random_ocl(cl_mem buf, int n, unsigned long long seed, unsigned int stream, unsigned int range);
+void run_generate(const char *kind, unsigned long long seed);
+
+// Streaming pipeline of stages connected by bounded queues
+struct Stage;
+struct Chunk;
+struct ChunkQueue;
+bool chunk_queue_push(ChunkQueue &q, int chunk);
+bool chunk_queue_pop(ChunkQueue &q, int *chunk);
+void chunk_queue_put(ChunkQueue &q, int chunk);
+int chunk_queue_take(ChunkQueue &q);
+void add_stage(const char *spec);
+void open_stage(Stage &stage, bool first);
+void close_stage(Stage &stage);
+void process_chunk(Stage &stage, Chunk &chunk, long index);
+void run_stage(int s);
+void print_summary(Stage &stage);
+void run_pipeline(const char *spec, int chunk, int depth);
+void run_follow(const char *path);
+
+// Memory budgets
+unsigned long long read_limit(const char *path);
+bool self_cgroup(char *cgroup, size_t size);
+cl_ulong host_memory_available();
+int plan_chunk(cl_ulong host_available, cl_ulong global_mem, cl_ulong max_alloc);
+void report_memory();
+
+// Device capabilities and recommended configuration
+struct DeviceConfig;
+DeviceConfig recommended_config(cl_kernel k);
+void inspect_variant(int id);
+void run_inspect();
+
+// Benchmark environment and noise control
+extern bool pin_threads;
+struct BenchEnvironment;
+int pin_current_thread(int slot);
+void read_line(const char *path, char *out, size_t size);
+BenchEnvironment capture_environment(bool device);
+void print_environment(const BenchEnvironment &env);
+void bench_stats(double *samples, int n, double *mean, double *stddev, double *cv, double *min, double *median);
+void run_bench(int reps, const char *backend);
+
+// Element-wise ops on two int vectors, each defined once here. The
+// expression is valid OpenCL C and C++ over the elements a and b: it becomes
+// both the kernel op_<name> in the generated source and the host loop
+// <name>_host, so the device and host paths can't drift apart.
+#define ELEMENTWISE_OPS(X) \
+    X(add, a + b) \
+    X(sub, a - b) \
+    X(mul, a * b) \
+    X(min, a < b ? a : b) \
+    X(max, a > b ? a : b) \
+    X(absdiff, a > b ? a - b : b - a)
+
+#define ELEMENTWISE_DECLARE(name, expr) void name##_host(const int *a, const int *b, int *c, int size);
+ELEMENTWISE_OPS(ELEMENTWISE_DECLARE)
+#undef ELEMENTWISE_DECLARE
+extern const char elementwise_source[];
+void run_ops();
+
+// Queue pool for concurrent small kernels
+struct QueuePool;
+cl_int setup_queue_pool(QueuePool &pool, cl_context ctx, cl_device_id dev, int n, bool load_aware);
+void free_queue_pool(QueuePool &pool);
+cl_command_queue acquire_queue(QueuePool &pool, int *q);
+void release_queue(QueuePool &pool, int q);
+cl_int release_queue_on_completion(QueuePool &pool, int q, cl_event last);
+double time_queue_pool(int clients, int jobs, long *mismatches);
+void run_queues(int n, const char *policy);
+
+// libvecops internals; the exported functions are declared in vecops.h
+int vecops_find_op(const char *op);
+int vecops_finish(vecops_job *job);
+
+// The library build (-DVECOPS_LIBRARY) leaves main() and the global
+// allocator to the program that embeds it
+#ifndef VECOPS_LIBRARY
 
 // Main function to run the OpenCL code
 int main(int argc, char **argv) {
@@ -37,18 +280,123 @@ int main(int argc, char **argv) {
     if (argc > 1) {
         SZ = atoi(argv[1]);
     }
+    pin_threads = getenv("TASK_PIN") != NULL;
+
+    // An optional second argument selects a mode other than the vector add
+    if (argc > 2 && strcmp(argv[2], "layout") == 0) {
+        run_layout();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "segreduce") == 0) {
+        run_segmented_reduce();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "topk") == 0) {
+        run_topk(argc > 3 ? atoi(argv[3]) : 10);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "host") == 0) {
+        run_host();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "serve") == 0) {
+        run_server();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "scaling") == 0) {
+        run_scaling(argc > 3 ? atoi(argv[3]) : 0);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "explain") == 0) {
+        run_explain(argc > 3 ? argv[3] : "");
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "gen") == 0) {
+        run_generate(argc > 3 ? argv[3] : "random", argc > 4 ? strtoull(argv[4], NULL, 10) : 1);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "alloccheck") == 0) {
+        run_alloc_check();
+        return 0;
+    }
+    if (argc > 3 && strcmp(argv[2], "replay") == 0) {
+        run_replay(argv[3], argc > 4 ? argv[4] : "timed");
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "pipeline") == 0) {
+        run_pipeline(argc > 3 ? argv[3] : "gen,device,verify", argc > 4 ? atoi(argv[4]) : 0,
+                     argc > 5 ? atoi(argv[5]) : 0);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "bench") == 0) {
+        run_bench(argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? argv[4] : "device");
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "queues") == 0) {
+        run_queues(argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? argv[4] : "roundrobin");
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "checksum") == 0) {
+        run_checksum();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "ops") == 0) {
+        run_ops();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "inspect") == 0) {
+        run_inspect();
+        return 0;
+    }
+    if (argc > 3 && strcmp(argv[2], "follow") == 0) {
+        run_follow(argv[3]);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "loadgen") == 0) {
+        run_loadgen(argc > 3 ? argv[3] : "open", argc > 4 ? argv[4] : "100,1000,10000",
+                    argc > 5 ? argv[5] : "fixed", argc > 6 ? atof(argv[6]) : 2.0);
+        return 0;
+    }
+
+    // Stream in chunks when three full vectors don't fit the host or device budget
+    cl_ulong global_mem = 0, max_alloc = 0;
+    device_id = create_device();
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    cl_ulong host_available = host_memory_available();
+    int chunk = plan_chunk(host_available, global_mem, max_alloc);
+    if (chunk == 0) {
+        printf("%d elements need %.1f MB, but %.1f MB host and %.1f MB device available can't even hold "
+               "%d chunks of %d elements\n",
+               SZ, 3.0 * SZ * sizeof(int) / (1024 * 1024), host_available / (1024.0 * 1024),
+               global_mem / (1024.0 * 1024), STREAM_DEPTH, MIN_STREAM_CHUNK);
+        exit(1);
+    }
+    if (chunk < SZ) {
+        printf("%d elements need %.1f MB; %.1f MB host and %.1f MB device available, streaming in chunks of %d\n",
+               SZ, 3.0 * SZ * sizeof(int) / (1024 * 1024), host_available / (1024.0 * 1024),
+               global_mem / (1024.0 * 1024), chunk);
+        // Same inputs as init() and the same three printed lines as below
+        run_pipeline("gen:rand,device,print:summary", chunk, STREAM_DEPTH);
+        report_memory();
+        return 0;
+    }
 
     // Initialize the vectors with random data
+    perf_begin("init");
     init(v1, SZ);
     init(v2, SZ);
     init(v_out, SZ);
+    perf_end();
 
     // Set the global work size for OpenCL
     size_t global[1] = {(size_t)SZ};
 
     // Print initial vector data
+    perf_begin("print");
     print(v1, SZ);
     print(v2, SZ);
+    perf_end();
 
     // Setup OpenCL environment: device, context, queue, and kernel
     setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
@@ -63,14 +411,16 @@ int main(int argc, char **argv) {
     auto start = std::chrono::high_resolution_clock::now();
 
     // Execute the kernel
-    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, &event);
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 1, &bufV_out_migrated, &event);
     clWaitForEvents(1, &event); // Wait for the kernel to finish execution
 
     // Read the output data from the OpenCL device to host
     clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), &v_out[0], 0, NULL, NULL);
 
     // Print the output data
+    perf_begin("print output");
     print(v_out, SZ);
+    perf_end();
 
     // Stop measuring time and calculate the elapsed time
     auto stop = std::chrono::high_resolution_clock::now();
@@ -78,14 +428,56 @@ int main(int argc, char **argv) {
 
     // Display the kernel execution time
     printf("Kernel Execution Time: %f ms\n", elapsed_time.count());
+    perf_report();
+    report_memory();
 
     // Free all allocated memory and OpenCL objects
     free_memory();
 }
 
+#endif // VECOPS_LIBRARY
+
+// Function to allocate host memory and count the allocation
+void *host_malloc(size_t size) {
+    host_allocations++;
+    return malloc(size);
+}
+
+#ifndef VECOPS_LIBRARY
+// Global operator new and delete count every C++ allocation made by the program
+void *operator new(size_t size) {
+    host_allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+#endif // VECOPS_LIBRARY
+
 // Function to initialize a vector with random data
 void init(int *&A, int size) {
-    A = (int *)malloc(sizeof(int) * size); // Allocate memory for the vector
+    A = (int *)host_malloc(sizeof(int) * size); // Allocate memory for the vector
 
     for (long i = 0; i < size; i++) {
         A[i] = rand() % 100; // Initialize with random integers from 0 to 99
@@ -120,10 +512,15 @@ void free_memory() {
     clReleaseMemObject(bufV1);
     clReleaseMemObject(bufV2);
     clReleaseMemObject(bufV_out);
+    if (bufV_out_migrated != NULL) {
+        clReleaseEvent(bufV_out_migrated);
+        bufV_out_migrated = NULL;
+    }
 
     clReleaseKernel(kernel);
     clReleaseCommandQueue(queue);
     clReleaseProgram(program);
+    free_variants();
     clReleaseContext(context);
 
     free(v1);
@@ -154,10 +551,32 @@ void setup_kernel_memory() {
     // Write data to buffers
     clEnqueueWriteBuffer(queue, bufV1, CL_TRUE, 0, SZ * sizeof(int), &v1[0], 0, NULL, NULL);
     clEnqueueWriteBuffer(queue, bufV2, CL_TRUE, 0, SZ * sizeof(int), &v2[0], 0, NULL, NULL);
+
+    // Place the output on the device now rather than when the kernel first
+    // writes it; its contents don't need to move. The first kernel on the
+    // buffers passes the event in its wait list.
+    if (bufV_out_migrated != NULL) {
+        clReleaseEvent(bufV_out_migrated);
+    }
+    err = clEnqueueMigrateMemObjects(queue, 1, &bufV_out, CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0, NULL,
+                                     &bufV_out_migrated);
+    check_error(err, "Couldn't migrate the output buffer");
 }
 
 // Function to set up OpenCL device, context, queue, and kernel
 void setup_openCL_device_context_queue_kernel(const char *filename, const char *kernelname) {
+    // Create the device, context and command queue
+    setup_openCL_device_context_queue();
+
+    // Get the OpenCL program; registered variants are compiled concurrently
+    program = get_program(filename, NULL);
+
+    // Create the OpenCL kernel
+    kernel = create_kernel(program, kernelname);
+}
+
+// Function to set up the OpenCL device, context and queue without building a program
+void setup_openCL_device_context_queue() {
     device_id = create_device(); // Create the OpenCL device
     cl_int err;
 
@@ -168,48 +587,53 @@ void setup_openCL_device_context_queue_kernel(const char *filename, const char *
         exit(1);
     }
 
-    // Build the OpenCL program from source
-    program = build_program(context, device_id, filename);
-
     // Create the command queue
     queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
     if (err < 0) {
         perror("Couldn't create a command queue");
         exit(1);
     }
+}
 
-    // Create the OpenCL kernel
-    kernel = clCreateKernel(program, kernelname, &err);
+// Function to create a named kernel from a built program
+cl_kernel create_kernel(cl_program prog, const char *kernelname) {
+    cl_int err;
+    cl_kernel k = clCreateKernel(prog, kernelname, &err);
     if (err < 0) {
         perror("Couldn't create a kernel");
         printf("Error code = %d", err);
         exit(1);
     }
+    return k;
+}
+
+// Function to report an OpenCL error and exit
+void check_error(int err, const char *message) {
+    if (err < 0) {
+        perror(message);
+        printf("Error code = %d\n", err);
+        exit(1);
+    }
 }
 
 // Function to build an OpenCL program from a source file
 cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename) {
+    return build_program_with_options(ctx, dev, filename, NULL);
+}
+
+// Function to build an OpenCL program from a source file with compiler options
+cl_program build_program_with_options(cl_context ctx, cl_device_id dev, const char *filename, const char *options) {
     cl_program program;
-    FILE *program_handle; // File handle to read the source
     char *program_buffer; // Buffer for source code
     size_t program_size, log_size;
 
-    // Open the source file
-    program_handle = fopen(filename, "r");
-    if (program_handle == NULL) {
+    // Read the source code
+    program_buffer = read_source(filename, &program_size);
+    if (program_buffer == NULL) {
         perror("Couldn't find the program file");
         exit(1);
     }
 
-    // Read the source code
-    fseek(program_handle, 0, SEEK_END);
-    program_size = ftell(program_handle);
-    rewind(program_handle);
-    program_buffer = (char *)malloc(program_size + 1); 
-    program_buffer[program_size] = '\0'; // Null-terminate the source
-    fread(program_buffer, sizeof(char), program_size, program_handle);
-    fclose(program_handle); // Close the file
-
     // Create the OpenCL program
     program = clCreateProgramWithSource(ctx, 1, (const char **)&program_buffer, &program_size, &err);
     if (err < 0) {
@@ -219,11 +643,11 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
     free(program_buffer); // Free the buffer
 
     // Build the OpenCL program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
     if (err < 0) {
         // If there's a build error, retrieve and display the build log
         clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *program_log = (char *)malloc(log_size + 1);
+        char *program_log = (char *)host_malloc(log_size + 1);
         program_log[log_size] = '\0';
         clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL);
         printf("%s\n", program_log);
@@ -234,12 +658,44 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char *filename)
     return program; // Return the built program
 }
 
-// Function to create an OpenCL device
+// Function to read a whole source file into a null-terminated buffer; returns NULL if it can't be opened
+char *read_source(const char *filename, size_t *size) {
+    // The element-wise ops are generated into the executable, not read from a file
+    if (strcmp(filename, ELEMENTWISE_SOURCE_NAME) == 0) {
+        *size = strlen(elementwise_source);
+        char *program_buffer = (char *)host_malloc(*size + 1);
+        memcpy(program_buffer, elementwise_source, *size + 1);
+        return program_buffer;
+    }
+
+    FILE *program_handle = fopen(filename, "r");
+    if (program_handle == NULL) {
+        return NULL;
+    }
+
+    fseek(program_handle, 0, SEEK_END);
+    size_t program_size = ftell(program_handle);
+    rewind(program_handle);
+    char *program_buffer = (char *)host_malloc(program_size + 1);
+    program_buffer[program_size] = '\0'; // Null-terminate the source
+    program_size = fread(program_buffer, sizeof(char), program_size, program_handle);
+    fclose(program_handle);
+
+    *size = program_size;
+    return program_buffer;
+}
+
+// Function to create an OpenCL device. Discovery runs once; later calls reuse the result.
 cl_device_id create_device() {
+   static cl_device_id cached_dev = NULL;
    cl_platform_id platform;
    cl_device_id dev;
    int err;
 
+   if (cached_dev != NULL) {
+      return cached_dev;
+   }
+
    // Identify an OpenCL platform
    err = clGetPlatformIDs(1, &platform, NULL);
    if(err < 0) {
@@ -258,5 +714,5131 @@ cl_device_id create_device() {
       exit(1);
    }
 
+   cached_dev = dev;
    return dev; // Return the device identifier
 }
+
+// ---------------------------------------------------------------------------
+// Layout conversion: AoS <-> SoA and blocked transpose
+// ---------------------------------------------------------------------------
+
+#define LAYOUT_TILE_DIM 16  // Must match TILE_DIM in layout_ops.txt
+#define HOST_TILE_DIM 32    // Block size for the host transpose
+
+// Kernels built from layout_ops.txt
+cl_program layout_program;
+cl_kernel aos_to_soa_kernel, soa_to_aos_kernel, transpose_kernel;
+
+// Function to split n interleaved (x,y,z,w) records into four arrays in one pass
+void aos_to_soa(const int *aos, int n, int *x, int *y, int *z, int *w) {
+    const int *__restrict in = aos;
+    int *__restrict ox = x;
+    int *__restrict oy = y;
+    int *__restrict oz = z;
+    int *__restrict ow = w;
+
+    for (long i = 0; i < n; i++) {
+        ox[i] = in[4 * i + 0];
+        oy[i] = in[4 * i + 1];
+        oz[i] = in[4 * i + 2];
+        ow[i] = in[4 * i + 3];
+    }
+}
+
+// Function to interleave four arrays into n (x,y,z,w) records in one pass
+void soa_to_aos(const int *x, const int *y, const int *z, const int *w, int n, int *aos) {
+    int *__restrict out = aos;
+
+    for (long i = 0; i < n; i++) {
+        out[4 * i + 0] = x[i];
+        out[4 * i + 1] = y[i];
+        out[4 * i + 2] = z[i];
+        out[4 * i + 3] = w[i];
+    }
+}
+
+// Function to transpose a rows x cols matrix block by block so that both
+// the source and destination blocks stay cache resident
+void transpose_blocked(const int *in, int rows, int cols, int *out) {
+    for (long rb = 0; rb < rows; rb += HOST_TILE_DIM) {
+        long r_end = rb + HOST_TILE_DIM < rows ? rb + HOST_TILE_DIM : rows;
+        for (long cb = 0; cb < cols; cb += HOST_TILE_DIM) {
+            long c_end = cb + HOST_TILE_DIM < cols ? cb + HOST_TILE_DIM : cols;
+            for (long r = rb; r < r_end; r++) {
+                for (long c = cb; c < c_end; c++) {
+                    out[c * rows + r] = in[r * cols + c];
+                }
+            }
+        }
+    }
+}
+
+// Function to build the layout program and create its kernels
+void setup_layout_kernels() {
+    layout_program = get_program("./layout_ops.txt", NULL);
+    aos_to_soa_kernel = create_kernel(layout_program, "aos_to_soa4");
+    soa_to_aos_kernel = create_kernel(layout_program, "soa4_to_aos");
+    transpose_kernel = create_kernel(layout_program, "transpose_tiled");
+}
+
+// Function to release the layout program and its kernels
+void free_layout_kernels() {
+    clReleaseKernel(aos_to_soa_kernel);
+    clReleaseKernel(soa_to_aos_kernel);
+    clReleaseKernel(transpose_kernel);
+    clReleaseProgram(layout_program);
+}
+
+// Function to enqueue the AoS -> SoA kernel on n records
+void aos_to_soa_ocl(cl_mem aos, int n, cl_mem x, cl_mem y, cl_mem z, cl_mem w) {
+    size_t global[1] = {(size_t)n};
+
+    err = clSetKernelArg(aos_to_soa_kernel, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(aos_to_soa_kernel, 1, sizeof(cl_mem), (void *)&aos);
+    err |= clSetKernelArg(aos_to_soa_kernel, 2, sizeof(cl_mem), (void *)&x);
+    err |= clSetKernelArg(aos_to_soa_kernel, 3, sizeof(cl_mem), (void *)&y);
+    err |= clSetKernelArg(aos_to_soa_kernel, 4, sizeof(cl_mem), (void *)&z);
+    err |= clSetKernelArg(aos_to_soa_kernel, 5, sizeof(cl_mem), (void *)&w);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueNDRangeKernel(queue, aos_to_soa_kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the AoS to SoA kernel");
+}
+
+// Function to enqueue the SoA -> AoS kernel on n records
+void soa_to_aos_ocl(cl_mem x, cl_mem y, cl_mem z, cl_mem w, int n, cl_mem aos) {
+    size_t global[1] = {(size_t)n};
+
+    err = clSetKernelArg(soa_to_aos_kernel, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(soa_to_aos_kernel, 1, sizeof(cl_mem), (void *)&x);
+    err |= clSetKernelArg(soa_to_aos_kernel, 2, sizeof(cl_mem), (void *)&y);
+    err |= clSetKernelArg(soa_to_aos_kernel, 3, sizeof(cl_mem), (void *)&z);
+    err |= clSetKernelArg(soa_to_aos_kernel, 4, sizeof(cl_mem), (void *)&w);
+    err |= clSetKernelArg(soa_to_aos_kernel, 5, sizeof(cl_mem), (void *)&aos);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueNDRangeKernel(queue, soa_to_aos_kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the SoA to AoS kernel");
+}
+
+// Function to enqueue the tiled transpose of a rows x cols matrix
+void transpose_ocl(cl_mem in, int rows, int cols, cl_mem out) {
+    // Round the grid up to whole tiles; the kernel guards the edges
+    size_t local[2] = {LAYOUT_TILE_DIM, LAYOUT_TILE_DIM};
+    size_t global[2] = {
+        (size_t)(cols + LAYOUT_TILE_DIM - 1) / LAYOUT_TILE_DIM * LAYOUT_TILE_DIM,
+        (size_t)(rows + LAYOUT_TILE_DIM - 1) / LAYOUT_TILE_DIM * LAYOUT_TILE_DIM};
+
+    err = clSetKernelArg(transpose_kernel, 0, sizeof(int), (void *)&rows);
+    err |= clSetKernelArg(transpose_kernel, 1, sizeof(int), (void *)&cols);
+    err |= clSetKernelArg(transpose_kernel, 2, sizeof(cl_mem), (void *)&in);
+    err |= clSetKernelArg(transpose_kernel, 3, sizeof(cl_mem), (void *)&out);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueNDRangeKernel(queue, transpose_kernel, 2, NULL, global, local, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the transpose kernel");
+}
+
+// Function to run the layout conversions on the device and check them against the host
+void run_layout() {
+    int n = SZ / 4;                    // Number of (x,y,z,w) records
+    if (n == 0) {
+        printf("The layout mode needs SZ of at least 4\n");
+        exit(1);
+    }
+
+    // The transpose reads the record array as a matrix, so it must fit in
+    // the 4 * n ints allocated, which are fewer than SZ when 4 doesn't divide it
+    int side = 1;                      // Square matrix side for the transpose
+    while ((long)(side + 1) * (side + 1) <= 4L * n) {
+        side++;
+    }
+
+    int *aos, *soa, *aos_back, *host_soa, *mat_t, *host_mat_t;
+    init(aos, 4 * n);
+    init(soa, 4 * n);
+    init(aos_back, 4 * n);
+    init(host_soa, 4 * n);
+    init(mat_t, side * side);
+    init(host_mat_t, side * side);
+
+    print(aos, 4 * n);
+
+    // Host reference conversions
+    perf_begin("host aos->soa");
+    auto start = std::chrono::high_resolution_clock::now();
+    aos_to_soa(aos, n, host_soa, host_soa + n, host_soa + 2 * n, host_soa + 3 * n);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> host_aos_time = stop - start;
+    perf_end();
+
+    perf_begin("host transpose");
+    start = std::chrono::high_resolution_clock::now();
+    transpose_blocked(aos, side, side, host_mat_t);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> host_transpose_time = stop - start;
+    perf_end();
+
+    // Device conversions
+    setup_openCL_device_context_queue();
+    setup_layout_kernels();
+
+    size_t rec_bytes = (size_t)n * 4 * sizeof(int);
+    size_t mat_bytes = (size_t)side * side * sizeof(int);
+    cl_mem buf_aos = clCreateBuffer(context, CL_MEM_READ_WRITE, rec_bytes, NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_soa = clCreateBuffer(context, CL_MEM_READ_WRITE, rec_bytes, NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_mat_t = clCreateBuffer(context, CL_MEM_READ_WRITE, mat_bytes, NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    clEnqueueWriteBuffer(queue, buf_aos, CL_TRUE, 0, rec_bytes, aos, 0, NULL, NULL);
+
+    // Each SoA stream gets its own buffer
+    cl_mem soa_parts[4];
+    for (int k = 0; k < 4; k++) {
+        soa_parts[k] = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)n * sizeof(int), NULL, &err);
+        check_error(err, "Couldn't create a buffer");
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    aos_to_soa_ocl(buf_aos, n, soa_parts[0], soa_parts[1], soa_parts[2], soa_parts[3]);
+    clFinish(queue);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> dev_aos_time = stop - start;
+
+    start = std::chrono::high_resolution_clock::now();
+    soa_to_aos_ocl(soa_parts[0], soa_parts[1], soa_parts[2], soa_parts[3], n, buf_soa);
+    clFinish(queue);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> dev_soa_time = stop - start;
+
+    start = std::chrono::high_resolution_clock::now();
+    transpose_ocl(buf_aos, side, side, buf_mat_t);
+    clFinish(queue);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> dev_transpose_time = stop - start;
+
+    // Read back and compare against the host results
+    for (int k = 0; k < 4; k++) {
+        clEnqueueReadBuffer(queue, soa_parts[k], CL_TRUE, 0, (size_t)n * sizeof(int), soa + (size_t)k * n, 0, NULL, NULL);
+    }
+    clEnqueueReadBuffer(queue, buf_soa, CL_TRUE, 0, rec_bytes, aos_back, 0, NULL, NULL);
+    clEnqueueReadBuffer(queue, buf_mat_t, CL_TRUE, 0, mat_bytes, mat_t, 0, NULL, NULL);
+
+    long mismatches = 0;
+    for (long i = 0; i < 4L * n; i++) {
+        mismatches += (soa[i] != host_soa[i]) + (aos_back[i] != aos[i]);
+    }
+    for (long i = 0; i < (long)side * side; i++) {
+        mismatches += (mat_t[i] != host_mat_t[i]);
+    }
+
+    print(soa, 4 * n);
+
+    printf("AoS->SoA: host %f ms, device %f ms\n", host_aos_time.count(), dev_aos_time.count());
+    printf("SoA->AoS: device %f ms\n", dev_soa_time.count());
+    printf("Transpose %dx%d: host %f ms, device %f ms\n", side, side,
+           host_transpose_time.count(), dev_transpose_time.count());
+    printf("Layout mismatches: %ld\n", mismatches);
+    perf_report();
+
+    for (int k = 0; k < 4; k++) {
+        clReleaseMemObject(soa_parts[k]);
+    }
+    clReleaseMemObject(buf_aos);
+    clReleaseMemObject(buf_soa);
+    clReleaseMemObject(buf_mat_t);
+    free_layout_kernels();
+    clReleaseCommandQueue(queue);
+    free_variants();
+    clReleaseContext(context);
+
+    free(aos);
+    free(soa);
+    free(aos_back);
+    free(host_soa);
+    free(mat_t);
+    free(host_mat_t);
+}
+
+// ---------------------------------------------------------------------------
+// Segmented reductions and reduce-by-key
+// ---------------------------------------------------------------------------
+
+#define SEG_SUM 0
+#define SEG_MIN 1
+#define SEG_MAX 2
+#define SEG_NUM_OPS 3
+#define SEG_GROUP_SIZE 256  // Work-group size of the segmented scan
+
+const char *seg_op_names[SEG_NUM_OPS] = {"sum", "min", "max"};
+
+// One program per reduction operator, built from segmented_ops.txt
+cl_program seg_programs[SEG_NUM_OPS];
+cl_kernel seg_scan_kernels[SEG_NUM_OPS], seg_apply_kernels[SEG_NUM_OPS];
+cl_kernel seg_offsets_flags_kernels[SEG_NUM_OPS], seg_offset_tails_kernels[SEG_NUM_OPS];
+cl_kernel seg_key_heads_kernels[SEG_NUM_OPS], seg_key_tails_kernels[SEG_NUM_OPS];
+
+// Function to return the identity element of a reduction operator
+int seg_identity(int op) {
+    return op == SEG_SUM ? 0 : (op == SEG_MIN ? INT_MAX : INT_MIN);
+}
+
+// Function to combine two values with a reduction operator
+int seg_combine(int op, int a, int b) {
+    if (op == SEG_SUM) {
+        return a + b;
+    }
+    if (op == SEG_MIN) {
+        return a < b ? a : b;
+    }
+    return a > b ? a : b;
+}
+
+// Function to reduce each segment [offsets[s], offsets[s+1]) on the host
+void segmented_reduce_offsets(const int *values, const int *offsets, int num_segments, int op, int *result) {
+    for (int s = 0; s < num_segments; s++) {
+        int acc = seg_identity(op);
+        for (long i = offsets[s]; i < offsets[s + 1]; i++) {
+            acc = seg_combine(op, acc, values[i]);
+        }
+        result[s] = acc;
+    }
+}
+
+// Function to reduce each run of equal keys on the host; returns the number of runs
+int reduce_by_key(const int *keys, const int *values, int n, int op, int *keys_out, int *result) {
+    int count = 0;
+    for (long i = 0; i < n; i++) {
+        if (i == 0 || keys[i] != keys[i - 1]) {
+            keys_out[count] = keys[i];
+            result[count] = seg_identity(op);
+            count++;
+        }
+        result[count - 1] = seg_combine(op, result[count - 1], values[i]);
+    }
+    return count;
+}
+
+// Function to build one segmented program per operator and create its kernels
+void setup_segmented_kernels() {
+    char options[32];
+    for (int op = 0; op < SEG_NUM_OPS; op++) {
+        snprintf(options, sizeof(options), "-DSEG_OP=%d", op);
+        seg_programs[op] = get_program("./segmented_ops.txt", options);
+        seg_scan_kernels[op] = create_kernel(seg_programs[op], "segmented_scan_groups");
+        seg_apply_kernels[op] = create_kernel(seg_programs[op], "segmented_scan_apply");
+        seg_offsets_flags_kernels[op] = create_kernel(seg_programs[op], "offsets_to_flags");
+        seg_offset_tails_kernels[op] = create_kernel(seg_programs[op], "gather_offset_tails");
+        seg_key_heads_kernels[op] = create_kernel(seg_programs[op], "key_heads");
+        seg_key_tails_kernels[op] = create_kernel(seg_programs[op], "gather_key_tails");
+    }
+}
+
+// Function to release the segmented programs and their kernels
+void free_segmented_kernels() {
+    for (int op = 0; op < SEG_NUM_OPS; op++) {
+        clReleaseKernel(seg_scan_kernels[op]);
+        clReleaseKernel(seg_apply_kernels[op]);
+        clReleaseKernel(seg_offsets_flags_kernels[op]);
+        clReleaseKernel(seg_offset_tails_kernels[op]);
+        clReleaseKernel(seg_key_heads_kernels[op]);
+        clReleaseKernel(seg_key_tails_kernels[op]);
+        clReleaseProgram(seg_programs[op]);
+    }
+}
+
+// Function to enqueue an inclusive segmented scan of n elements. Each level
+// scans inside work-groups; the per-group totals are scanned recursively and
+// folded back into the elements before each group's first segment head.
+// A NULL flags buffer gives a plain (unsegmented) scan.
+void segmented_scan_ocl(cl_mem in, cl_mem flags, int n, int op, cl_mem out) {
+    int groups = (n + SEG_GROUP_SIZE - 1) / SEG_GROUP_SIZE;
+    size_t global[1] = {(size_t)groups * SEG_GROUP_SIZE};
+    size_t local[1] = {SEG_GROUP_SIZE};
+
+    cl_mem group_val = clCreateBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem group_flag = clCreateBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem first_head = clCreateBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    cl_kernel scan = seg_scan_kernels[op];
+    err = clSetKernelArg(scan, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(scan, 1, sizeof(cl_mem), (void *)&in);
+    err |= clSetKernelArg(scan, 2, sizeof(cl_mem), (void *)&flags);
+    err |= clSetKernelArg(scan, 3, sizeof(cl_mem), (void *)&out);
+    err |= clSetKernelArg(scan, 4, sizeof(cl_mem), (void *)&group_val);
+    err |= clSetKernelArg(scan, 5, sizeof(cl_mem), (void *)&group_flag);
+    err |= clSetKernelArg(scan, 6, sizeof(cl_mem), (void *)&first_head);
+    err |= clSetKernelArg(scan, 7, SEG_GROUP_SIZE * sizeof(int), NULL);
+    err |= clSetKernelArg(scan, 8, SEG_GROUP_SIZE * sizeof(int), NULL);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueNDRangeKernel(queue, scan, 1, NULL, global, local, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the segmented scan kernel");
+
+    if (groups > 1) {
+        // Scan the group totals, then carry them into the next groups
+        cl_mem carry = clCreateBuffer(context, CL_MEM_READ_WRITE, groups * sizeof(int), NULL, &err);
+        check_error(err, "Couldn't create a buffer");
+        segmented_scan_ocl(group_val, group_flag, groups, op, carry);
+
+        cl_kernel apply = seg_apply_kernels[op];
+        err = clSetKernelArg(apply, 0, sizeof(int), (void *)&n);
+        err |= clSetKernelArg(apply, 1, sizeof(cl_mem), (void *)&out);
+        err |= clSetKernelArg(apply, 2, sizeof(cl_mem), (void *)&carry);
+        err |= clSetKernelArg(apply, 3, sizeof(cl_mem), (void *)&first_head);
+        check_error(err, "Couldn't create a kernel argument");
+
+        err = clEnqueueNDRangeKernel(queue, apply, 1, NULL, global, local, 0, NULL, NULL);
+        check_error(err, "Couldn't enqueue the segmented apply kernel");
+        clReleaseMemObject(carry);
+    }
+
+    // Released buffers stay alive until the enqueued kernels have used them
+    clReleaseMemObject(group_val);
+    clReleaseMemObject(group_flag);
+    clReleaseMemObject(first_head);
+}
+
+// Function to reduce each segment [offsets[s], offsets[s+1]) of a device vector.
+// offsets holds num_segments + 1 entries; result receives num_segments values.
+void segmented_reduce_offsets_ocl(cl_mem values, int n, cl_mem offsets, int num_segments, int op, cl_mem result) {
+    size_t global_s[1] = {(size_t)num_segments};
+    int zero = 0;
+
+    cl_mem flags = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem scanned = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    // Mark segment heads
+    err = clEnqueueFillBuffer(queue, flags, &zero, sizeof(int), 0, n * sizeof(int), 0, NULL, NULL);
+    check_error(err, "Couldn't clear the flags buffer");
+    cl_kernel mark = seg_offsets_flags_kernels[op];
+    err = clSetKernelArg(mark, 0, sizeof(int), (void *)&num_segments);
+    err |= clSetKernelArg(mark, 1, sizeof(cl_mem), (void *)&offsets);
+    err |= clSetKernelArg(mark, 2, sizeof(cl_mem), (void *)&flags);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, mark, 1, NULL, global_s, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the offsets kernel");
+
+    segmented_scan_ocl(values, flags, n, op, scanned);
+
+    // The last scanned element of each segment is its reduction
+    cl_kernel gather = seg_offset_tails_kernels[op];
+    err = clSetKernelArg(gather, 0, sizeof(int), (void *)&num_segments);
+    err |= clSetKernelArg(gather, 1, sizeof(cl_mem), (void *)&offsets);
+    err |= clSetKernelArg(gather, 2, sizeof(cl_mem), (void *)&scanned);
+    err |= clSetKernelArg(gather, 3, sizeof(cl_mem), (void *)&result);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, gather, 1, NULL, global_s, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the gather kernel");
+
+    clReleaseMemObject(flags);
+    clReleaseMemObject(scanned);
+}
+
+// Function to reduce each run of equal keys of a device vector. keys_out and
+// result must hold up to n entries; returns the number of runs.
+int reduce_by_key_ocl(cl_mem keys, cl_mem values, int n, int op, cl_mem keys_out, cl_mem result) {
+    if (n <= 0) {
+        return 0;
+    }
+    size_t global[1] = {(size_t)n};
+
+    cl_mem flags = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem seg_index = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem scanned = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    // Mark run heads
+    cl_kernel heads = seg_key_heads_kernels[op];
+    err = clSetKernelArg(heads, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(heads, 1, sizeof(cl_mem), (void *)&keys);
+    err |= clSetKernelArg(heads, 2, sizeof(cl_mem), (void *)&flags);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, heads, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the key heads kernel");
+
+    // A plain sum-scan of the heads numbers the runs; the segmented scan reduces them
+    segmented_scan_ocl(flags, NULL, n, SEG_SUM, seg_index);
+    segmented_scan_ocl(values, flags, n, op, scanned);
+
+    cl_kernel gather = seg_key_tails_kernels[op];
+    err = clSetKernelArg(gather, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(gather, 1, sizeof(cl_mem), (void *)&keys);
+    err |= clSetKernelArg(gather, 2, sizeof(cl_mem), (void *)&flags);
+    err |= clSetKernelArg(gather, 3, sizeof(cl_mem), (void *)&seg_index);
+    err |= clSetKernelArg(gather, 4, sizeof(cl_mem), (void *)&scanned);
+    err |= clSetKernelArg(gather, 5, sizeof(cl_mem), (void *)&keys_out);
+    err |= clSetKernelArg(gather, 6, sizeof(cl_mem), (void *)&result);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, gather, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the gather kernel");
+
+    // Only the run count comes back to the host
+    int count = 0;
+    clEnqueueReadBuffer(queue, seg_index, CL_TRUE, (size_t)(n - 1) * sizeof(int), sizeof(int), &count, 0, NULL, NULL);
+
+    clReleaseMemObject(flags);
+    clReleaseMemObject(seg_index);
+    clReleaseMemObject(scanned);
+    return count;
+}
+
+// Function to run vector_add_ocl and reduce its output per segment on the device
+void run_segmented_reduce() {
+    // Random segment lengths between 1 and 2000 elements
+    int capacity = 1024, num_segments = 0;
+    int *offsets = (int *)host_malloc(sizeof(int) * (capacity + 1));
+    offsets[0] = 0;
+    while (offsets[num_segments] < SZ) {
+        if (num_segments == capacity) {
+            int *grown = (int *)host_malloc(sizeof(int) * (2 * capacity + 1));
+            memcpy(grown, offsets, sizeof(int) * (capacity + 1));
+            free(offsets);
+            offsets = grown;
+            capacity *= 2;
+        }
+        int len = rand() % 2000 + 1;
+        offsets[num_segments + 1] = offsets[num_segments] + len < SZ ? offsets[num_segments] + len : SZ;
+        num_segments++;
+    }
+
+    // Keys label every element with its segment number
+    int *keys = (int *)host_malloc(sizeof(int) * SZ);
+    for (int s = 0; s < num_segments; s++) {
+        for (long i = offsets[s]; i < offsets[s + 1]; i++) {
+            keys[i] = s;
+        }
+    }
+
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    for (long i = 0; i < SZ; i++) {
+        v_out[i] = v1[i] + v2[i]; // Host copy of what vector_add_ocl produces
+    }
+
+    // Produce v_out on the device; it is never read back in full
+    size_t global[1] = {(size_t)SZ};
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+    setup_kernel_memory();
+    copy_kernel_args();
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 1, &bufV_out_migrated, NULL);
+
+    setup_segmented_kernels();
+
+    cl_mem buf_offsets = clCreateBuffer(context, CL_MEM_READ_ONLY, (num_segments + 1) * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_keys = clCreateBuffer(context, CL_MEM_READ_ONLY, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_keys_out = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_result = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    clEnqueueWriteBuffer(queue, buf_offsets, CL_TRUE, 0, (num_segments + 1) * sizeof(int), offsets, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, buf_keys, CL_TRUE, 0, SZ * sizeof(int), keys, 0, NULL, NULL);
+
+    int *result = (int *)host_malloc(sizeof(int) * num_segments);
+    int *host_result = (int *)host_malloc(sizeof(int) * num_segments);
+    int *keys_out = (int *)host_malloc(sizeof(int) * num_segments);
+    int *host_keys_out = (int *)host_malloc(sizeof(int) * num_segments);
+
+    printf("Segments: %d\n", num_segments);
+    for (int op = 0; op < SEG_NUM_OPS; op++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        segmented_reduce_offsets_ocl(bufV_out, SZ, buf_offsets, num_segments, op, buf_result);
+        clFinish(queue);
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+
+        clEnqueueReadBuffer(queue, buf_result, CL_TRUE, 0, num_segments * sizeof(int), result, 0, NULL, NULL);
+        perf_begin("verify segments");
+        segmented_reduce_offsets(v_out, offsets, num_segments, op, host_result);
+        perf_end();
+
+        long mismatches = 0;
+        for (int s = 0; s < num_segments; s++) {
+            mismatches += (result[s] != host_result[s]);
+        }
+        printf("Segmented %s: %f ms, mismatches %ld\n", seg_op_names[op], elapsed_time.count(), mismatches);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int count = reduce_by_key_ocl(buf_keys, bufV_out, SZ, SEG_SUM, buf_keys_out, buf_result);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+
+    perf_begin("verify by key");
+    int host_count = reduce_by_key(keys, v_out, SZ, SEG_SUM, host_keys_out, host_result);
+    perf_end();
+    long mismatches = (count != host_count);
+    if (count == host_count) {
+        clEnqueueReadBuffer(queue, buf_result, CL_TRUE, 0, count * sizeof(int), result, 0, NULL, NULL);
+        clEnqueueReadBuffer(queue, buf_keys_out, CL_TRUE, 0, count * sizeof(int), keys_out, 0, NULL, NULL);
+        for (int s = 0; s < count; s++) {
+            mismatches += (result[s] != host_result[s]) + (keys_out[s] != host_keys_out[s]);
+        }
+    }
+    printf("Reduce-by-key sum: %d runs, %f ms, mismatches %ld\n", count, elapsed_time.count(), mismatches);
+    perf_report();
+
+    clReleaseMemObject(buf_offsets);
+    clReleaseMemObject(buf_keys);
+    clReleaseMemObject(buf_keys_out);
+    clReleaseMemObject(buf_result);
+    free_segmented_kernels();
+    free_memory();
+
+    free(offsets);
+    free(keys);
+    free(result);
+    free(host_result);
+    free(keys_out);
+    free(host_keys_out);
+}
+
+// ---------------------------------------------------------------------------
+// Top-k selection
+// ---------------------------------------------------------------------------
+
+#define TOPK_TILE 1024       // Must match TOPK_TILE in topk_ops.txt
+#define TOPK_GROUP_SIZE 256
+#define TOPK_MAX_K 256       // Keeps every pass at least a 4x reduction
+
+// Kernel built from topk_ops.txt
+cl_program topk_program;
+cl_kernel topk_kernel;
+
+// Function to select the k largest values on the host with a size-k min-heap.
+// Ties go to the lower index, matching the device kernel.
+void topk(const int *values, int n, int k, int *out_values, int *out_indices) {
+    // Heap order keeps the weakest selected element at the front
+    auto ranks_higher = [values](int a, int b) {
+        return values[a] > values[b] || (values[a] == values[b] && a < b);
+    };
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (count < k) {
+            out_indices[count++] = i;
+            std::push_heap(out_indices, out_indices + count, ranks_higher);
+        } else if (ranks_higher(i, out_indices[0])) {
+            std::pop_heap(out_indices, out_indices + count, ranks_higher);
+            out_indices[count - 1] = i;
+            std::push_heap(out_indices, out_indices + count, ranks_higher);
+        }
+    }
+
+    std::sort_heap(out_indices, out_indices + count, ranks_higher);
+    for (int j = 0; j < count; j++) {
+        out_values[j] = values[out_indices[j]];
+    }
+}
+
+// Function to build the top-k program and create its kernel
+void setup_topk_kernels() {
+    topk_program = get_program("./topk_ops.txt", NULL);
+    topk_kernel = create_kernel(topk_program, "topk_tile");
+}
+
+// Function to release the top-k program and kernel
+void free_topk_kernels() {
+    clReleaseKernel(topk_kernel);
+    clReleaseProgram(topk_program);
+}
+
+// Function to write the k largest values of a device vector and their indices,
+// in descending order, to out_values and out_indices (k <= TOPK_MAX_K, k <= n)
+void topk_ocl(cl_mem values, int n, int k, cl_mem out_values, cl_mem out_indices) {
+    cl_mem cur_values = values;
+    cl_mem cur_indices = NULL; // Positions in the original vector
+    int count = n;
+    size_t local[1] = {TOPK_GROUP_SIZE};
+
+    while (true) {
+        int groups = (count + TOPK_TILE - 1) / TOPK_TILE;
+        size_t global[1] = {(size_t)groups * TOPK_GROUP_SIZE};
+
+        cl_mem next_values = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)groups * k * sizeof(int), NULL, &err);
+        check_error(err, "Couldn't create a buffer");
+        cl_mem next_indices = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)groups * k * sizeof(int), NULL, &err);
+        check_error(err, "Couldn't create a buffer");
+
+        err = clSetKernelArg(topk_kernel, 0, sizeof(int), (void *)&count);
+        err |= clSetKernelArg(topk_kernel, 1, sizeof(int), (void *)&k);
+        err |= clSetKernelArg(topk_kernel, 2, sizeof(cl_mem), (void *)&cur_values);
+        err |= clSetKernelArg(topk_kernel, 3, sizeof(cl_mem), (void *)&cur_indices);
+        err |= clSetKernelArg(topk_kernel, 4, sizeof(cl_mem), (void *)&next_values);
+        err |= clSetKernelArg(topk_kernel, 5, sizeof(cl_mem), (void *)&next_indices);
+        err |= clSetKernelArg(topk_kernel, 6, TOPK_TILE * sizeof(int), NULL);
+        err |= clSetKernelArg(topk_kernel, 7, TOPK_TILE * sizeof(int), NULL);
+        check_error(err, "Couldn't create a kernel argument");
+
+        err = clEnqueueNDRangeKernel(queue, topk_kernel, 1, NULL, global, local, 0, NULL, NULL);
+        check_error(err, "Couldn't enqueue the top-k kernel");
+
+        if (cur_values != values) {
+            clReleaseMemObject(cur_values);
+            clReleaseMemObject(cur_indices);
+        }
+        cur_values = next_values;
+        cur_indices = next_indices;
+        count = groups * k;
+
+        if (groups == 1) {
+            break;
+        }
+    }
+
+    // The single remaining tile holds the sorted top k
+    clEnqueueCopyBuffer(queue, cur_values, out_values, 0, 0, k * sizeof(int), 0, NULL, NULL);
+    clEnqueueCopyBuffer(queue, cur_indices, out_indices, 0, 0, k * sizeof(int), 0, NULL, NULL);
+    clReleaseMemObject(cur_values);
+    clReleaseMemObject(cur_indices);
+}
+
+// Function to run vector_add_ocl and select the k largest outputs on the device
+void run_topk(int k) {
+    if (k < 1 || k > TOPK_MAX_K || k > SZ) {
+        printf("k must be between 1 and %d and at most SZ\n", TOPK_MAX_K);
+        exit(1);
+    }
+
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+
+    size_t global[1] = {(size_t)SZ};
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+    setup_kernel_memory();
+    copy_kernel_args();
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 1, &bufV_out_migrated, NULL);
+
+    setup_topk_kernels();
+    cl_mem buf_values = clCreateBuffer(context, CL_MEM_READ_WRITE, k * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    cl_mem buf_indices = clCreateBuffer(context, CL_MEM_READ_WRITE, k * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    clFinish(queue);
+    auto start = std::chrono::high_resolution_clock::now();
+    topk_ocl(bufV_out, SZ, k, buf_values, buf_indices);
+
+    // Only k values and k indices are read back
+    int *values = (int *)malloc(sizeof(int) * k);
+    int *indices = (int *)malloc(sizeof(int) * k);
+    clEnqueueReadBuffer(queue, buf_values, CL_TRUE, 0, k * sizeof(int), values, 0, NULL, NULL);
+    clEnqueueReadBuffer(queue, buf_indices, CL_TRUE, 0, k * sizeof(int), indices, 0, NULL, NULL);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+
+    // Host reference on the same sums
+    perf_begin("verify top-k");
+    for (long i = 0; i < SZ; i++) {
+        v_out[i] = v1[i] + v2[i];
+    }
+    int *host_values = (int *)malloc(sizeof(int) * k);
+    int *host_indices = (int *)malloc(sizeof(int) * k);
+    topk(v_out, SZ, k, host_values, host_indices);
+    perf_end();
+
+    long mismatches = 0;
+    for (int j = 0; j < k; j++) {
+        mismatches += (values[j] != host_values[j]) + (indices[j] != host_indices[j]);
+    }
+
+    print(values, k);
+    printf("Top-%d Time: %f ms, mismatches %ld\n", k, elapsed_time.count(), mismatches);
+    perf_report();
+
+    clReleaseMemObject(buf_values);
+    clReleaseMemObject(buf_indices);
+    free_topk_kernels();
+    free_memory();
+    free(values);
+    free(indices);
+    free(host_values);
+    free(host_indices);
+}
+
+// ---------------------------------------------------------------------------
+// On-device checksums
+// ---------------------------------------------------------------------------
+
+#define CHECKSUM_GROUP_SIZE 256
+#define CHECKSUM_GROUPS 256  // Groups per pass, so 2 * 256 partials are read back
+
+// Order-independent checksum of an int vector: the wrapping sum of the
+// values and the xor of a hash of every (index, value) pair
+struct Checksum {
+    unsigned int sum;
+    unsigned int mix;
+};
+
+// Kernels built from checksum_ops.txt
+cl_program checksum_program;
+cl_kernel checksum_kernel, checksum_ref_kernel;
+cl_mem buf_partials;
+
+// Function to hash an element's index and value (must match checksum_mix in checksum_ops.txt)
+unsigned int checksum_mix(unsigned int i, unsigned int v) {
+    unsigned int h = i * 0x9E3779B1u ^ v;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Function to checksum n ints on the host; matches checksum_int
+Checksum checksum_host(const int *data, long n) {
+    Checksum c = {0, 0};
+    for (long i = 0; i < n; i++) {
+        c.sum += (unsigned int)data[i];
+        c.mix ^= checksum_mix(i, data[i]);
+    }
+    return c;
+}
+
+// Function to checksum the sums a[i] + b[i] on the host without storing
+// them; matches checksum_add_ref
+Checksum checksum_add_host(const int *a, const int *b, long n) {
+    Checksum c = {0, 0};
+    for (long i = 0; i < n; i++) {
+        unsigned int v = (unsigned int)a[i] + (unsigned int)b[i];
+        c.sum += v;
+        c.mix ^= checksum_mix(i, v);
+    }
+    return c;
+}
+
+// Function to build the checksum program, create its kernels and the partials buffer
+void setup_checksum_kernels() {
+    checksum_program = get_program("./checksum_ops.txt", NULL);
+    checksum_kernel = create_kernel(checksum_program, "checksum_int");
+    checksum_ref_kernel = create_kernel(checksum_program, "checksum_add_ref");
+    buf_partials = clCreateBuffer(context, CL_MEM_READ_WRITE, 2 * CHECKSUM_GROUPS * sizeof(cl_uint), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+}
+
+// Function to release the checksum program, kernels and partials buffer
+void free_checksum_kernels() {
+    clReleaseMemObject(buf_partials);
+    clReleaseKernel(checksum_kernel);
+    clReleaseKernel(checksum_ref_kernel);
+    clReleaseProgram(checksum_program);
+}
+
+// Function to run a checksum kernel whose arguments before the partials are
+// set, read back the per-group pairs and combine them
+Checksum checksum_run(cl_kernel k, int first_arg, int n) {
+    int groups = (n + CHECKSUM_GROUP_SIZE - 1) / CHECKSUM_GROUP_SIZE;
+    groups = std::max(1, std::min(groups, CHECKSUM_GROUPS));
+    size_t local[1] = {CHECKSUM_GROUP_SIZE};
+    size_t global[1] = {(size_t)groups * CHECKSUM_GROUP_SIZE};
+
+    err = clSetKernelArg(k, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(k, first_arg, sizeof(cl_mem), (void *)&buf_partials);
+    err |= clSetKernelArg(k, first_arg + 1, CHECKSUM_GROUP_SIZE * sizeof(cl_uint), NULL);
+    err |= clSetKernelArg(k, first_arg + 2, CHECKSUM_GROUP_SIZE * sizeof(cl_uint), NULL);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, k, 1, NULL, global, local, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the kernel");
+
+    cl_uint partials[2 * CHECKSUM_GROUPS];
+    clEnqueueReadBuffer(queue, buf_partials, CL_TRUE, 0, 2 * groups * sizeof(cl_uint), partials, 0, NULL, NULL);
+    Checksum c = {0, 0};
+    for (int g = 0; g < groups; g++) {
+        c.sum += partials[2 * g];
+        c.mix ^= partials[2 * g + 1];
+    }
+    return c;
+}
+
+// Function to checksum n ints of a device buffer
+Checksum checksum_ocl(cl_mem data, int n) {
+    err = clSetKernelArg(checksum_kernel, 1, sizeof(cl_mem), (void *)&data);
+    check_error(err, "Couldn't create a kernel argument");
+    return checksum_run(checksum_kernel, 2, n);
+}
+
+// Function to checksum the expected sums of two device buffers
+Checksum checksum_add_ocl(cl_mem a, cl_mem b, int n) {
+    err = clSetKernelArg(checksum_ref_kernel, 1, sizeof(cl_mem), (void *)&a);
+    err |= clSetKernelArg(checksum_ref_kernel, 2, sizeof(cl_mem), (void *)&b);
+    check_error(err, "Couldn't create a kernel argument");
+    return checksum_run(checksum_ref_kernel, 3, n);
+}
+
+// Function to verify vector_add_ocl by comparing checksums of its output and
+// of the expected sums, both computed on the device, so v_out is never read
+// back. The host checksum of its own copy of the inputs must agree too; a
+// full readback is timed for comparison.
+void run_checksum() {
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+
+    size_t global[1] = {(size_t)SZ};
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+    setup_kernel_memory();
+    copy_kernel_args();
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 1, &bufV_out_migrated, NULL);
+    setup_checksum_kernels();
+    clFinish(queue);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Checksum output = checksum_ocl(bufV_out, SZ);
+    Checksum reference = checksum_add_ocl(bufV1, bufV2, SZ);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> device_time = stop - start;
+
+    perf_begin("host checksum");
+    Checksum host = checksum_add_host(v1, v2, SZ);
+    perf_end();
+
+    start = std::chrono::high_resolution_clock::now();
+    clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), v_out, 0, NULL, NULL);
+    Checksum readback = checksum_host(v_out, SZ);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> readback_time = stop - start;
+
+    printf("%-18s %10s %10s\n", "checksum", "sum", "mix");
+    printf("%-18s %10u %10x\n", "device output", output.sum, output.mix);
+    printf("%-18s %10u %10x\n", "device reference", reference.sum, reference.mix);
+    printf("%-18s %10u %10x\n", "host reference", host.sum, host.mix);
+    printf("%-18s %10u %10x\n", "readback", readback.sum, readback.mix);
+    printf("Device checksums: %f ms, readback and host checksum: %f ms\n", device_time.count(),
+           readback_time.count());
+    perf_report();
+
+    bool match = output.sum == reference.sum && output.mix == reference.mix && reference.sum == host.sum &&
+                 reference.mix == host.mix && readback.sum == host.sum && readback.mix == host.mix;
+    free_checksum_kernels();
+    free_memory();
+    if (!match) {
+        printf("FAILED: checksums differ\n");
+        exit(1);
+    }
+    printf("Checksums match\n");
+}
+
+// ---------------------------------------------------------------------------
+// Concurrent kernel variant compilation
+// ---------------------------------------------------------------------------
+
+#define VARIANT_PENDING 0
+#define VARIANT_READY 1
+#define VARIANT_FAILED 2
+
+// A kernel variant is one program built from a source file with a set of options
+struct KernelVariant {
+    const char *filename;
+    const char *options;
+    cl_program program;
+    int status;
+    char *log;        // Build log or error message when the build failed
+    double build_ms;  // Wall time of the build
+};
+
+// Every program the modes can ask for. The first request for any of them
+// starts all builds on a pool of compile threads, the requested one first.
+KernelVariant variants[] = {
+    {"./vector_ops.txt", NULL, NULL, VARIANT_PENDING, NULL, 0},
+    {"./layout_ops.txt", NULL, NULL, VARIANT_PENDING, NULL, 0},
+    {"./segmented_ops.txt", "-DSEG_OP=0", NULL, VARIANT_PENDING, NULL, 0},
+    {"./segmented_ops.txt", "-DSEG_OP=1", NULL, VARIANT_PENDING, NULL, 0},
+    {"./segmented_ops.txt", "-DSEG_OP=2", NULL, VARIANT_PENDING, NULL, 0},
+    {"./topk_ops.txt", NULL, NULL, VARIANT_PENDING, NULL, 0},
+    {"./checksum_ops.txt", NULL, NULL, VARIANT_PENDING, NULL, 0},
+    {"./generate_ops.txt", NULL, NULL, VARIANT_PENDING, NULL, 0},
+    {ELEMENTWISE_SOURCE_NAME, NULL, NULL, VARIANT_PENDING, NULL, 0},
+};
+const int num_variants = sizeof(variants) / sizeof(variants[0]);
+
+std::mutex variant_mutex;
+std::condition_variable variant_cv;
+std::vector<std::thread> variant_workers;
+std::vector<int> variant_order;         // Build order, requested variant first
+std::atomic<int> variant_next(0);       // Next position in variant_order to build
+bool variants_started = false;
+
+// Function to find a registered variant by source file and options; returns -1 if unknown
+int find_variant(const char *filename, const char *options) {
+    for (int id = 0; id < num_variants; id++) {
+        bool same_options = (options == NULL || variants[id].options == NULL)
+                                ? options == variants[id].options
+                                : strcmp(options, variants[id].options) == 0;
+        if (strcmp(filename, variants[id].filename) == 0 && same_options) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Function to start building every variant for the current context and device.
+// Each compile thread takes the next variant in the order until none are left.
+void start_variant_builds(int first) {
+    std::lock_guard<std::mutex> lock(variant_mutex);
+    if (variants_started) {
+        return;
+    }
+    variants_started = true;
+
+    variant_order.push_back(first);
+    for (int id = 0; id < num_variants; id++) {
+        if (id != first) {
+            variant_order.push_back(id);
+        }
+    }
+
+    // Compile threads must be joined before static destructors run, including on exit(1)
+    static bool joined_at_exit = false;
+    if (!joined_at_exit) {
+        atexit(join_variant_workers);
+        joined_at_exit = true;
+    }
+
+    int threads = (int)std::thread::hardware_concurrency();
+    threads = threads < 1 ? 1 : (threads > num_variants ? num_variants : threads);
+    for (int t = 0; t < threads; t++) {
+        variant_workers.push_back(std::thread(build_variant_worker));
+    }
+}
+
+// Function to build a program without exiting on failure, for use off the
+// main thread. On failure returns NULL and sets *log to a malloc'd message.
+cl_program compile_program(const char *filename, const char *options, char **log) {
+    cl_int build_err;
+    size_t program_size, log_size;
+    *log = NULL;
+
+    char *program_buffer = read_source(filename, &program_size);
+    if (program_buffer == NULL) {
+        *log = strdup("Couldn't find the program file");
+        return NULL;
+    }
+
+    cl_program prog = clCreateProgramWithSource(context, 1, (const char **)&program_buffer, &program_size, &build_err);
+    free(program_buffer);
+    if (build_err < 0) {
+        *log = strdup("Couldn't create the program");
+        return NULL;
+    }
+
+    if (clBuildProgram(prog, 1, &device_id, options, NULL, NULL) < 0) {
+        clGetProgramBuildInfo(prog, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        *log = (char *)host_malloc(log_size + 1);
+        (*log)[log_size] = '\0';
+        clGetProgramBuildInfo(prog, device_id, CL_PROGRAM_BUILD_LOG, log_size + 1, *log, NULL);
+        clReleaseProgram(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// Function run by each compile thread
+void build_variant_worker() {
+    int pos;
+    while ((pos = variant_next.fetch_add(1)) < num_variants) {
+        KernelVariant &v = variants[variant_order[pos]];
+        auto start = std::chrono::high_resolution_clock::now();
+
+        char *log = NULL;
+        cl_program prog = compile_program(v.filename, v.options, &log);
+
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+
+        // Publish the result and wake anyone waiting on this variant
+        std::lock_guard<std::mutex> lock(variant_mutex);
+        v.program = prog;
+        v.log = log;
+        v.build_ms = elapsed_time.count();
+        v.status = log == NULL ? VARIANT_READY : VARIANT_FAILED;
+        variant_cv.notify_all();
+    }
+}
+
+// Function to check without blocking whether a variant has finished building
+bool variant_ready(int id) {
+    std::lock_guard<std::mutex> lock(variant_mutex);
+    return variants[id].status == VARIANT_READY;
+}
+
+// Function to return a built program, waiting only for its own variant.
+// The caller owns the returned reference. Unregistered sources are built
+// synchronously.
+cl_program get_program(const char *filename, const char *options) {
+    int id = find_variant(filename, options);
+    if (id < 0) {
+        return build_program_with_options(context, device_id, filename, options);
+    }
+
+    start_variant_builds(id);
+
+    std::unique_lock<std::mutex> lock(variant_mutex);
+    variant_cv.wait(lock, [id] { return variants[id].status != VARIANT_PENDING; });
+    if (variants[id].status == VARIANT_FAILED) {
+        printf("%s: %s\n", variants[id].filename, variants[id].log);
+        lock.unlock();
+        exit(1);
+    }
+
+    clRetainProgram(variants[id].program);
+    return variants[id].program;
+}
+
+// Function to wait for the compile threads to finish
+void join_variant_workers() {
+    for (size_t t = 0; t < variant_workers.size(); t++) {
+        variant_workers[t].join();
+    }
+    variant_workers.clear();
+}
+
+// Function to wait for outstanding builds and release the registry's programs
+void free_variants() {
+    join_variant_workers();
+    variant_order.clear();
+    variant_next = 0;
+    variants_started = false;
+
+    for (int id = 0; id < num_variants; id++) {
+        if (variants[id].program) {
+            clReleaseProgram(variants[id].program);
+        }
+        free(variants[id].log);
+        variants[id].program = NULL;
+        variants[id].log = NULL;
+        variants[id].status = VARIANT_PENDING;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Resident server with kernel hot-reload
+// ---------------------------------------------------------------------------
+
+// A queued vector add request
+struct Job {
+    long id;
+    int size;
+    int tenant;
+    std::chrono::high_resolution_clock::time_point submitted;
+    void (*done)(long id, double latency_ms, void *arg);  // Optional completion callback
+    void *done_arg;
+    std::chrono::high_resolution_clock::time_point deadline;  // time_point::max() for none
+    bool cancelled;  // Set by server_cancel() while the job is queued
+};
+
+#define SERVER_MAX_TENANTS 16
+#define TENANT_QUEUE_CAPACITY 1024  // Jobs a tenant may have waiting; more are rejected
+#define LATENCY_SAMPLES 4096        // Most recent latencies kept per tenant
+#define SERVER_MEMORY_FRACTION 0.8  // Share of device or free host memory jobs may use
+#define SERVER_CHUNK (1 << 20)      // Elements per chunk; cancellation is checked between chunks
+
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LOW 2
+#define NUM_PRIORITIES 3
+
+// cl_khr_priority_hints, from cl_ext.h
+#ifndef CL_QUEUE_PRIORITY_KHR
+#define CL_QUEUE_PRIORITY_KHR 0x1096
+#define CL_QUEUE_PRIORITY_HIGH_KHR (1 << 0)
+#define CL_QUEUE_PRIORITY_MED_KHR (1 << 1)
+#define CL_QUEUE_PRIORITY_LOW_KHR (1 << 2)
+#endif
+
+const char *priority_names[NUM_PRIORITIES] = {"high", "normal", "low"};
+
+// A tenant of the server: its own fixed ring of waiting jobs, a weight for
+// its share of device time and the latencies of its recent jobs
+struct Tenant {
+    char name[32];
+    double weight;
+    int priority;
+    double vtime;      // Device time received divided by weight, in ms
+    Job ring[TENANT_QUEUE_CAPACITY];
+    int head, count;
+    long completed, rejected;
+    long stopped;      // Cancelled or past the deadline before finishing
+    cl_ulong outstanding_bytes;  // Buffer bytes of its queued and running jobs
+    double device_ms;
+    double latencies[LATENCY_SAMPLES];
+    long num_latencies;
+};
+
+// Tenants and their queues; no allocation happens when a job is queued
+std::mutex server_mutex;
+std::condition_variable server_cv;        // Signals a job queued or closing
+std::condition_variable server_space_cv;  // Signals a job done
+Tenant tenants[SERVER_MAX_TENANTS];
+int num_tenants = 0;
+int server_waiting = 0;      // Jobs queued over all tenants
+double server_vtime = 0;     // Virtual time of the most recently dispatched job
+cl_ulong server_memory_budget = 0;
+cl_ulong server_outstanding_bytes = 0;  // Buffer bytes of all queued and running jobs
+cl_command_queue priority_queues[NUM_PRIORITIES];  // NULL without cl_khr_priority_hints
+bool server_closing = false;
+bool server_quiet = false;  // Skip the per-job report line
+bool server_host_backend = false;  // Run jobs with vector_add_host (TASK_BACKEND=host)
+long server_next_id = 0;
+long server_running_id = -1;                 // Job the worker is running, -1 if idle
+std::atomic<bool> server_cancel_running(false);  // Stop the running job at its next chunk
+long server_completed = 0;
+int server_capacity = 0;    // Elements the host arrays and device buffers can hold
+cl_command_queue server_buffers_queue = NULL;  // Queue the device buffers were last migrated to
+cl_event server_buffers_migrated = NULL;       // That migration, until a job's first kernel has waited for it
+long server_migrations = 0;     // Buffer migrations between queues
+double server_migrate_ms = 0;   // Their device time
+std::thread server_worker_thread;
+
+// Kernel rebuilt by the watcher, waiting to be swapped in between jobs
+std::mutex reload_mutex;
+cl_program reload_program = NULL;
+cl_kernel reload_kernel = NULL;
+std::atomic<bool> watcher_stop(false);
+
+// Function to return the buffer bytes a job of size elements is charged
+// against the memory budget: its two inputs and its output
+cl_ulong server_job_bytes(int size) {
+    return 3 * (cl_ulong)size * sizeof(int);
+}
+
+// Function to grow the host arrays and device buffers to hold size elements.
+// Buffers are only reallocated when a job is larger than any before it.
+void server_ensure_capacity(int size) {
+    if (size <= server_capacity) {
+        return;
+    }
+    if (server_capacity > 0) {
+        if (!server_host_backend) {
+            clReleaseMemObject(bufV1);
+            clReleaseMemObject(bufV2);
+            clReleaseMemObject(bufV_out);
+        }
+        free(v1);
+        free(v2);
+        free(v_out);
+    }
+
+    SZ = size;
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    if (!server_host_backend) {
+        setup_kernel_memory();
+        server_buffers_queue = queue; // Written there
+    }
+    server_capacity = size;
+}
+
+// Function to move the device buffers to queue q's device before a job
+// there, unless they were last moved to q. Nothing is copied: every chunk
+// rewrites its inputs and reads back its output. The job's first kernel
+// waits for the migration. Jobs share the buffers and end with a blocking
+// read, so the migration can't overlap an earlier job's device work.
+void server_migrate_buffers(cl_command_queue q) {
+    if (server_host_backend || server_capacity == 0 || q == server_buffers_queue) {
+        return;
+    }
+    if (server_buffers_migrated != NULL) {
+        clReleaseEvent(server_buffers_migrated);
+    }
+    cl_mem bufs[3] = {bufV1, bufV2, bufV_out};
+    err = clEnqueueMigrateMemObjects(q, 3, bufs, CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0, NULL,
+                                     &server_buffers_migrated);
+    check_error(err, "Couldn't migrate the buffers");
+    server_buffers_queue = q;
+}
+
+// Function to run the write, kernel and read of elements [offset, offset + count)
+// of one add on the device buffers; the kernel first waits for wait unless it is NULL
+void server_run_device_job(cl_command_queue q, int size, int offset, int count, cl_event wait) {
+    size_t global_offset[1] = {(size_t)offset};
+    size_t global[1] = {(size_t)count};
+    size_t bytes = count * sizeof(int);
+    clEnqueueWriteBuffer(q, bufV1, CL_FALSE, offset * sizeof(int), bytes, v1 + offset, 0, NULL, NULL);
+    clEnqueueWriteBuffer(q, bufV2, CL_FALSE, offset * sizeof(int), bytes, v2 + offset, 0, NULL, NULL);
+
+    err = clSetKernelArg(kernel, 0, sizeof(int), (void *)&size);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&bufV1);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&bufV2);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&bufV_out);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueNDRangeKernel(q, kernel, 1, global_offset, global, NULL, wait != NULL ? 1 : 0,
+                                 wait != NULL ? &wait : NULL, NULL);
+    check_error(err, "Couldn't enqueue the kernel");
+    clEnqueueReadBuffer(q, bufV_out, CL_TRUE, offset * sizeof(int), bytes, v_out + offset, 0, NULL, NULL);
+}
+
+// Function to return the queue a tenant's jobs run on: the one matching its
+// priority hint when the device has priority queues, else the main queue.
+// Jobs run one at a time on one set of buffers, so more queues would only
+// change which queue does the work, not overlap it.
+cl_command_queue server_job_queue(int tenant) {
+    cl_command_queue q = priority_queues[tenants[tenant].priority];
+    return q != NULL ? q : queue;
+}
+
+// Function to check whether a job has been cancelled or is past its deadline
+bool server_job_stopped(const Job &job) {
+    return job.cancelled || server_cancel_running || std::chrono::high_resolution_clock::now() > job.deadline;
+}
+
+// Function to run one vector add on the warm buffers; returns its service
+// time in ms. The job runs in chunks and stops before the next chunk once it
+// is cancelled or past its deadline; *completed gets the elements finished.
+double server_run_job(const Job &job, int *completed, double *migrate_ms) {
+    long id = job.id;
+    int size = job.size;
+    long allocations = host_allocations;
+    long creations = cl_object_creations;
+    auto start = std::chrono::high_resolution_clock::now();
+    *completed = 0;
+    *migrate_ms = 0;
+
+    // A job cancelled or past its deadline while it waited is dropped before
+    // it grows or moves the buffers, so it costs its tenant no device time
+    if (server_job_stopped(job)) {
+        if (!server_quiet) {
+            printf("job %ld (%s): %s before it started (latency %f ms)\n", id, tenants[job.tenant].name,
+                   job.cancelled || server_cancel_running ? "cancelled" : "deadline passed",
+                   std::chrono::duration<double, std::milli>(start - job.submitted).count());
+            fflush(stdout);
+        }
+        return 0;
+    }
+
+    cl_command_queue q = server_job_queue(job.tenant);
+    server_ensure_capacity(size);
+    server_migrate_buffers(q);
+    while (*completed < size) {
+        if (server_job_stopped(job)) {
+            break;
+        }
+        int count = std::min(SERVER_CHUNK, size - *completed);
+        if (server_host_backend) {
+            vector_add_host(v1 + *completed, v2 + *completed, v_out + *completed, count);
+        } else {
+            server_run_device_job(q, size, *completed, count, server_buffers_migrated);
+            if (server_buffers_migrated != NULL) {
+                *migrate_ms = event_span_ms(server_buffers_migrated, server_buffers_migrated);
+                clReleaseEvent(server_buffers_migrated);
+                server_buffers_migrated = NULL;
+            }
+        }
+        *completed += count;
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> service_time = stop - start;
+    std::chrono::duration<double, std::milli> latency = stop - job.submitted;
+
+    // Anything allocated or created while the job ran is reported with it
+    allocations = host_allocations - allocations;
+    creations = cl_object_creations - creations;
+    if (!server_quiet && (allocations > 0 || creations > 0)) {
+        printf("job %ld: %ld host allocations, %ld OpenCL objects created\n", id, allocations, creations);
+    }
+    if (!server_quiet && *completed < size) {
+        printf("job %ld (%s): %s after %d of %d elements in %f ms (latency %f ms)\n", id, tenants[job.tenant].name,
+               job.cancelled || server_cancel_running ? "cancelled" : "deadline passed", *completed, size,
+               service_time.count(), latency.count());
+        fflush(stdout);
+    } else if (!server_quiet) {
+        printf("job %ld (%s): add %d in %f ms (latency %f ms", id, tenants[job.tenant].name, size,
+               service_time.count(), latency.count());
+        if (*migrate_ms > 0) {
+            printf(", buffers migrated in %f ms", *migrate_ms);
+        }
+        printf(")\n");
+        fflush(stdout);
+    }
+    return service_time.count();
+}
+
+// Function to install a kernel rebuilt by the watcher. Called between jobs by
+// the worker; kernels already enqueued keep their own reference, so nothing
+// has to drain and the buffers stay as they are.
+void server_swap_kernel() {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    if (reload_kernel == NULL) {
+        return;
+    }
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    kernel = reload_kernel;
+    program = reload_program;
+    reload_kernel = NULL;
+    reload_program = NULL;
+}
+
+// Function to find a tenant by name, adding it with weight 1 and normal
+// priority if it is new; returns -1 when the tenant table is full.
+// Call with server_mutex held.
+int server_tenant(const char *name) {
+    for (int t = 0; t < num_tenants; t++) {
+        if (strcmp(tenants[t].name, name) == 0) {
+            return t;
+        }
+    }
+    if (num_tenants == SERVER_MAX_TENANTS) {
+        return -1;
+    }
+    Tenant &tenant = tenants[num_tenants];
+    snprintf(tenant.name, sizeof(tenant.name), "%s", name);
+    tenant.weight = 1.0;
+    tenant.priority = PRIORITY_NORMAL;
+    tenant.vtime = server_vtime;
+    return num_tenants++;
+}
+
+// Function to set a tenant's share weight and priority hint
+void server_configure_tenant(const char *name, double weight, int priority) {
+    std::lock_guard<std::mutex> lock(server_mutex);
+    int t = server_tenant(name);
+    if (t < 0 || weight <= 0) {
+        printf("can't configure tenant %s\n", name);
+        return;
+    }
+    tenants[t].weight = weight;
+    tenants[t].priority = priority;
+}
+
+// Function to return the tenant whose job runs next: weighted fair queuing
+// on device time, so the waiting tenant that has received the least time for
+// its weight goes first. Call with server_mutex held; -1 if nothing waits.
+int server_next_tenant() {
+    int best = -1;
+    for (int t = 0; t < num_tenants; t++) {
+        if (tenants[t].count > 0 && (best < 0 || tenants[t].vtime < tenants[best].vtime)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+// Function to take the next job off its tenant's queue. Call with
+// server_mutex held and at least one job waiting.
+Job server_next_job() {
+    Tenant &tenant = tenants[server_next_tenant()];
+    Job job = tenant.ring[tenant.head];
+    tenant.head = (tenant.head + 1) % TENANT_QUEUE_CAPACITY;
+    tenant.count--;
+    server_waiting--;
+    server_vtime = tenant.vtime;
+    return job;
+}
+
+// Function run by the worker thread: jobs execute one at a time, in fair-share order
+void server_worker() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(server_mutex);
+        server_cv.wait(lock, [] { return server_closing || server_waiting > 0; });
+        if (server_waiting == 0) {
+            return; // Closing and drained
+        }
+        Job job = server_next_job();
+        server_running_id = job.id;
+        server_cancel_running = false;
+        lock.unlock();
+
+        server_swap_kernel();
+        int completed;
+        double migrate_ms;
+        double device_ms = server_run_job(job, &completed, &migrate_ms);
+        double latency_ms = std::chrono::duration<double, std::milli>(
+                                std::chrono::high_resolution_clock::now() - job.submitted).count();
+
+        // The callback runs before the job counts as completed, so
+        // server_wait_idle() also waits for it
+        if (job.done != NULL) {
+            job.done(job.id, latency_ms, job.done_arg);
+        }
+
+        // Charge the tenant for the device time it used and return the
+        // job's bytes to the budget
+        lock.lock();
+        server_running_id = -1;
+        Tenant &tenant = tenants[job.tenant];
+        cl_ulong bytes = server_job_bytes(job.size);
+        tenant.outstanding_bytes -= bytes;
+        server_outstanding_bytes -= bytes;
+        tenant.vtime += device_ms / tenant.weight;
+        tenant.device_ms += device_ms;
+        if (migrate_ms > 0) {
+            server_migrations++;
+            server_migrate_ms += migrate_ms;
+        }
+        tenant.latencies[tenant.num_latencies++ % LATENCY_SAMPLES] = latency_ms;
+        if (completed < job.size) {
+            tenant.stopped++;
+        } else {
+            tenant.completed++;
+        }
+        trace_job(job, completed, device_ms, latency_ms);
+        server_completed++;
+        server_space_cv.notify_all();
+    }
+}
+
+// Function to queue a vector add of size elements for a tenant. Admission
+// control rejects jobs whose buffers, together with those of the jobs
+// already queued or running, would exceed the memory budget, and jobs from
+// tenants whose queue is full. Returns whether it was queued.
+bool server_submit(int size, const char *tenant_name, void (*done)(long, double, void *), void *done_arg,
+                   double deadline_ms, long *id) {
+    std::unique_lock<std::mutex> lock(server_mutex);
+    int t = server_tenant(tenant_name);
+    if (t < 0) {
+        if (!server_quiet) {
+            printf("rejected: too many tenants\n");
+        }
+        return false;
+    }
+    Tenant &tenant = tenants[t];
+
+    cl_ulong bytes = server_job_bytes(size);
+    const char *reason = NULL;
+    if (bytes > server_memory_budget) {
+        reason = "exceeds the memory budget";
+    } else if (bytes > server_memory_budget - server_outstanding_bytes) {
+        reason = "memory budget in use";
+    } else if (tenant.count == TENANT_QUEUE_CAPACITY) {
+        reason = "queue full";
+    }
+    if (reason != NULL) {
+        tenant.rejected++;
+        if (!server_quiet) {
+            printf("rejected job from %s: %s (%llu of %llu bytes outstanding, %llu its own)\n", tenant.name,
+                   reason, (unsigned long long)server_outstanding_bytes, (unsigned long long)server_memory_budget,
+                   (unsigned long long)tenant.outstanding_bytes);
+        }
+        return false;
+    }
+
+    // A tenant returning from idle starts at the current virtual time, so
+    // it can't bank credit while it had nothing queued
+    if (tenant.count == 0 && tenant.vtime < server_vtime) {
+        tenant.vtime = server_vtime;
+    }
+
+    auto now = std::chrono::high_resolution_clock::now();
+    auto deadline = std::chrono::high_resolution_clock::time_point::max();
+    if (deadline_ms > 0) {
+        deadline = now + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                             std::chrono::duration<double, std::milli>(deadline_ms));
+    }
+    Job job = {server_next_id++, size, t, now, done, done_arg, deadline, false};
+    if (id != NULL) {
+        *id = job.id;
+    }
+    tenant.ring[(tenant.head + tenant.count) % TENANT_QUEUE_CAPACITY] = job;
+    tenant.count++;
+    tenant.outstanding_bytes += bytes;
+    server_outstanding_bytes += bytes;
+    server_waiting++;
+    server_cv.notify_one();
+    return true;
+}
+
+// Function to return the p-th percentile of n latencies (reorders them)
+double percentile(double *values, long n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    long k = (long)(p * (n - 1));
+    std::nth_element(values, values + k, values + n);
+    return values[k];
+}
+
+// Function to print per-tenant share and tail latency
+void server_report() {
+    std::lock_guard<std::mutex> lock(server_mutex);
+    double total_ms = 0;
+    for (int t = 0; t < num_tenants; t++) {
+        total_ms += tenants[t].device_ms;
+    }
+
+    printf("%-12s %6s %7s %9s %8s %7s %7s %10s %10s %10s\n",
+           "tenant", "weight", "prio", "completed", "rejected", "stopped", "share", "p50 ms", "p99 ms", "p999 ms");
+    std::vector<double> samples;
+    for (int t = 0; t < num_tenants; t++) {
+        Tenant &tenant = tenants[t];
+        long n = tenant.num_latencies < LATENCY_SAMPLES ? tenant.num_latencies : LATENCY_SAMPLES;
+        samples.assign(tenant.latencies, tenant.latencies + n);
+        printf("%-12s %6.2f %7s %9ld %8ld %7ld %6.1f%% %10.3f %10.3f %10.3f\n", tenant.name, tenant.weight,
+               priority_names[tenant.priority], tenant.completed, tenant.rejected, tenant.stopped,
+               total_ms > 0 ? 100 * tenant.device_ms / total_ms : 0.0,
+               percentile(samples.data(), n, 0.50), percentile(samples.data(), n, 0.99),
+               percentile(samples.data(), n, 0.999));
+    }
+    if (!server_host_backend) {
+        printf("buffer migrations between queues: %ld, %.3f ms\n", server_migrations, server_migrate_ms);
+    }
+    fflush(stdout);
+}
+
+// Function to wait until every submitted job has completed
+void server_wait_idle() {
+    std::unique_lock<std::mutex> lock(server_mutex);
+    server_space_cv.wait(lock, [] { return server_completed == server_next_id; });
+}
+
+// Function to cancel a job: a queued job is skipped when it comes up and the
+// running job stops before its next chunk. Returns false for unknown or
+// finished jobs.
+bool server_cancel(long id) {
+    std::lock_guard<std::mutex> lock(server_mutex);
+    if (id == server_running_id) {
+        server_cancel_running = true;
+        return true;
+    }
+    for (int t = 0; t < num_tenants; t++) {
+        Tenant &tenant = tenants[t];
+        for (int j = 0; j < tenant.count; j++) {
+            Job &job = tenant.ring[(tenant.head + j) % TENANT_QUEUE_CAPACITY];
+            if (job.id == id) {
+                job.cancelled = true;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Function to block until the tenant has room in its queue and a job of
+// size elements fits the memory left by the outstanding jobs; false if the
+// tenant can't be created or the job can never fit
+bool server_wait_space(const char *tenant_name, int size) {
+    std::unique_lock<std::mutex> lock(server_mutex);
+    int t = server_tenant(tenant_name);
+    cl_ulong bytes = server_job_bytes(size);
+    if (t < 0 || bytes > server_memory_budget) {
+        return false;
+    }
+    server_space_cv.wait(lock, [t, bytes] {
+        return tenants[t].count < TENANT_QUEUE_CAPACITY && bytes <= server_memory_budget - server_outstanding_bytes;
+    });
+    return true;
+}
+
+// Function to set up the device and warm buffers and start the worker thread
+void server_start() {
+    // TASK_BACKEND=host runs the jobs on the host, so the server and the load
+    // generator work on machines without an OpenCL device
+    const char *backend = getenv("TASK_BACKEND");
+    if (backend != NULL && strcmp(backend, "host") == 0) {
+        server_host_backend = true;
+        server_memory_budget = (cl_ulong)(host_memory_available() * SERVER_MEMORY_FRACTION);
+        trace_open();
+        server_tenant("default");
+        server_ensure_capacity(SZ);
+        server_worker_thread = std::thread(server_worker);
+        return;
+    }
+
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+
+    // Profiling queues, so buffer migrations can be timed on the device
+    clReleaseCommandQueue(queue);
+    cl_queue_properties profiling[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    queue = clCreateCommandQueueWithProperties(context, device_id, profiling, &err);
+    check_error(err, "Couldn't create a command queue");
+
+    // Admission budget from the device memory size
+    cl_ulong global_mem = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    server_memory_budget = (cl_ulong)(global_mem * SERVER_MEMORY_FRACTION);
+
+    // One queue per priority level when the device supports priority hints
+    char extensions[8192] = "";
+    clGetDeviceInfo(device_id, CL_DEVICE_EXTENSIONS, sizeof(extensions), extensions, NULL);
+    if (strstr(extensions, "cl_khr_priority_hints") != NULL) {
+        const cl_queue_properties levels[NUM_PRIORITIES] = {
+            CL_QUEUE_PRIORITY_HIGH_KHR, CL_QUEUE_PRIORITY_MED_KHR, CL_QUEUE_PRIORITY_LOW_KHR};
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            cl_queue_properties props[] = {CL_QUEUE_PRIORITY_KHR, levels[p], CL_QUEUE_PROPERTIES,
+                                           CL_QUEUE_PROFILING_ENABLE, 0};
+            priority_queues[p] = clCreateCommandQueueWithProperties(context, device_id, props, &err);
+            check_error(err, "Couldn't create a priority queue");
+        }
+    }
+
+    server_tenant("default");
+    server_ensure_capacity(SZ);
+    trace_open();
+    server_worker_thread = std::thread(server_worker);
+}
+
+// Function to finish the queued jobs, stop the worker and release everything
+void server_stop() {
+    {
+        std::lock_guard<std::mutex> lock(server_mutex);
+        server_closing = true;
+        server_cv.notify_all();
+    }
+    server_worker_thread.join();
+    trace_close();
+
+    if (server_host_backend) {
+        free(v1);
+        free(v2);
+        free(v_out);
+        return;
+    }
+    server_swap_kernel();
+    if (server_buffers_migrated != NULL) {
+        clReleaseEvent(server_buffers_migrated);
+        server_buffers_migrated = NULL;
+    }
+    server_buffers_queue = NULL;
+    for (int p = 0; p < NUM_PRIORITIES; p++) {
+        if (priority_queues[p] != NULL) {
+            clReleaseCommandQueue(priority_queues[p]);
+            priority_queues[p] = NULL;
+        }
+    }
+    free_memory();
+}
+
+// Function to rebuild every variant compiled from filename on the watcher
+// thread. A failed build leaves the running kernels untouched.
+void reload_variant(const char *filename) {
+    for (int id = 0; id < num_variants; id++) {
+        // Editors trigger events before the registry's builds have finished
+        std::unique_lock<std::mutex> lock(variant_mutex);
+        if (strcmp(variants[id].filename, filename) != 0 || variants[id].status == VARIANT_PENDING) {
+            continue;
+        }
+        lock.unlock();
+
+        auto start = std::chrono::high_resolution_clock::now();
+        char *log = NULL;
+        cl_program prog = compile_program(variants[id].filename, variants[id].options, &log);
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+
+        if (prog == NULL) {
+            printf("reload of %s failed, keeping the running kernel: %s\n", filename, log);
+            fflush(stdout);
+            free(log);
+            continue;
+        }
+
+        // Later get_program() calls see the new build
+        lock.lock();
+        if (variants[id].program) {
+            clReleaseProgram(variants[id].program);
+        }
+        variants[id].program = prog;
+        variants[id].status = VARIANT_READY;
+        variants[id].build_ms = elapsed_time.count();
+        lock.unlock();
+
+        // The server kernel comes from the vector_ops.txt variant
+        if (id == find_variant("./vector_ops.txt", NULL)) {
+            cl_int kernel_err;
+            cl_kernel k = clCreateKernel(prog, "vector_add_ocl", &kernel_err);
+            if (kernel_err < 0) {
+                printf("reload of %s has no vector_add_ocl kernel, keeping the running kernel\n", filename);
+                fflush(stdout);
+                continue;
+            }
+            clRetainProgram(prog);
+
+            std::lock_guard<std::mutex> reload_lock(reload_mutex);
+            if (reload_kernel != NULL) { // Superseded before the worker picked it up
+                clReleaseKernel(reload_kernel);
+                clReleaseProgram(reload_program);
+            }
+            reload_kernel = k;
+            reload_program = prog;
+        }
+        printf("reloaded %s in %f ms\n", filename, elapsed_time.count());
+        fflush(stdout);
+    }
+}
+
+// Function run by the watcher thread: inotify reports kernel sources written
+// or replaced in the working directory, and each is rebuilt in the background
+void watch_kernel_sources() {
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("Couldn't watch the kernel sources");
+        return;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[NAME_MAX + 3];
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    while (!watcher_stop) {
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue; // Timed out; check whether the server is shutting down
+        }
+        ssize_t len = read(fd, events, sizeof(events));
+        for (char *p = events; len > 0 && p < events + len;) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            if (e->len > 0) {
+                snprintf(path, sizeof(path), "./%s", e->name);
+                reload_variant(path); // Files that aren't kernel sources match no variant
+            }
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+    close(fd);
+}
+
+// Function to run a resident server: each stdin line "add <n> [tenant]"
+// queues a vector add on warm device buffers, "tenant <name> <weight>
+// [high|normal|low]" sets a tenant's share and priority hint, and "stats"
+// prints per-tenant latency. Edits to the kernel sources are recompiled and
+// swapped in without a restart. EOF or "quit" stops it.
+void run_server() {
+    server_start();
+    std::thread watcher(watch_kernel_sources);
+
+    char line[256];
+    char name[32], level[16];
+    int size;
+    double weight;
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        double deadline_ms = 0;
+        long id;
+        int fields = sscanf(line, "add %d %31s %lf", &size, name, &deadline_ms);
+        if (fields >= 1 && size > 0) {
+            if (server_submit(size, fields >= 2 ? name : "default", NULL, NULL, deadline_ms, &id)) {
+                printf("queued job %ld\n", id);
+            }
+        } else if (sscanf(line, "cancel %ld", &id) == 1) {
+            if (!server_cancel(id)) {
+                printf("job %ld is not queued or running\n", id);
+            }
+        } else if ((fields = sscanf(line, "tenant %31s %lf %15s", name, &weight, level)) >= 2) {
+            int priority = PRIORITY_NORMAL;
+            for (int p = 0; fields == 3 && p < NUM_PRIORITIES; p++) {
+                if (strcmp(level, priority_names[p]) == 0) {
+                    priority = p;
+                }
+            }
+            server_configure_tenant(name, weight, priority);
+        } else if (strncmp(line, "stats", 5) == 0) {
+            server_report();
+        } else if (strncmp(line, "quit", 4) == 0) {
+            break;
+        } else {
+            printf("unknown request: %s", line);
+        }
+    }
+
+    // Stop the watcher first so no reload races the shutdown
+    watcher_stop = true;
+    watcher.join();
+    server_stop();
+    server_report();
+}
+
+// Function to check that the server's steady state allocates nothing: after
+// warm-up jobs at full size, a batch of jobs of mixed sizes must not allocate
+// host memory or create OpenCL objects through clCreate*, and must release
+// every event its enqueue calls returned. Events themselves are created per
+// command by the runtime, so they are reported but not required to be zero.
+// Allocations inside the OpenCL runtime that bypass operator new are not
+// seen. Exits with status 1 if the check fails.
+void run_alloc_check() {
+    server_quiet = true;
+    server_start();
+
+    // Background compilation of the other variants must not count against the jobs
+    join_variant_workers();
+    // Jobs wait for room rather than being rejected by admission control
+    for (int j = 0; j < 4; j++) {
+        server_wait_space("default", SZ);
+        server_submit(SZ, "default");
+    }
+    server_wait_idle();
+
+    long allocations = host_allocations;
+    long creations = cl_object_creations;
+    long events = cl_events_created;
+    long references = cl_event_references;
+    const int jobs = 256;
+    for (int j = 0; j < jobs; j++) {
+        int size = 1 + rand() % SZ;
+        server_wait_space("default", size);
+        server_submit(size, "default");
+    }
+    server_wait_idle();
+    allocations = host_allocations - allocations;
+    creations = cl_object_creations - creations;
+    events = cl_events_created - events;
+    references = cl_event_references - references;
+
+    server_stop();
+
+    printf("Steady state over %d jobs: %ld host allocations, %ld OpenCL objects created, "
+           "%ld events returned, %ld not released\n", jobs, allocations, creations, events, references);
+    if (allocations != 0 || creations != 0) {
+        printf("FAILED: jobs allocate after warm-up\n");
+        exit(1);
+    }
+    if (references != 0) {
+        printf("FAILED: jobs leak events\n");
+        exit(1);
+    }
+    printf("PASSED\n");
+}
+
+// ---------------------------------------------------------------------------
+// Load generator
+// ---------------------------------------------------------------------------
+
+#define LOADGEN_MAX_SAMPLES (1 << 20)
+#define LOADGEN_MAX_CLIENTS 256
+
+// One submitted request: when it was meant to be sent and which client sent it
+struct LoadSlot {
+    std::chrono::high_resolution_clock::time_point intended;
+    int client;
+};
+
+LoadSlot *loadgen_slots = NULL;
+double *loadgen_latencies = NULL;
+std::atomic<long> loadgen_completed(0);
+std::mutex loadgen_mutex;
+std::condition_variable loadgen_cv;
+bool loadgen_client_done[LOADGEN_MAX_CLIENTS];
+int loadgen_base_size = 0;  // SZ at start; the server grows SZ with its buffers
+
+// Function to draw a job size from the named distribution around the base size
+int loadgen_size(const char *dist, std::mt19937 &rng) {
+    int base = loadgen_base_size;
+    double size = base;
+    if (strcmp(dist, "uniform") == 0) {
+        size = (double)std::uniform_int_distribution<long long>(1, 2 * (long long)base)(rng);
+    } else if (strcmp(dist, "lognormal") == 0) {
+        size = std::lognormal_distribution<double>(log((double)base), 1.0)(rng);
+    }
+    // The cap is worked out in double, as 16 * base can overflow int
+    double cap = std::min(16.0 * base, (double)INT_MAX);
+    return size < 1 ? 1 : size > cap ? (int)cap : (int)size;
+}
+
+// Completion callback: latency is measured from the intended send time, so a
+// generator that falls behind its schedule still sees the queueing delay.
+// The job id is not needed: the slot identifies the request.
+void loadgen_done(long, double latency_ms, void *arg) {
+    LoadSlot *slot = (LoadSlot *)arg;
+    latency_ms = std::chrono::duration<double, std::milli>(
+                     std::chrono::high_resolution_clock::now() - slot->intended).count();
+    loadgen_latencies[loadgen_completed++ % LOADGEN_MAX_SAMPLES] = latency_ms;
+
+    if (slot->client >= 0) {
+        std::lock_guard<std::mutex> lock(loadgen_mutex);
+        loadgen_client_done[slot->client] = true;
+        loadgen_cv.notify_all();
+    }
+}
+
+// Function to offer Poisson arrivals at rate jobs/s for the given time;
+// returns the number of rejected submissions
+long loadgen_open(double rate, const char *dist, double seconds) {
+    std::mt19937 rng(1);
+    std::exponential_distribution<double> gap(rate);
+    auto start = std::chrono::high_resolution_clock::now();
+    auto next = start;
+    long sent = 0;
+    long rejected = 0;
+
+    while (std::chrono::duration<double>(next - start).count() < seconds) {
+        std::this_thread::sleep_until(next);
+        LoadSlot &slot = loadgen_slots[sent++ % LOADGEN_MAX_SAMPLES];
+        slot.intended = next;
+        slot.client = -1;
+        if (!server_submit(loadgen_size(dist, rng), "loadgen", loadgen_done, &slot)) {
+            rejected++;
+        }
+        next += std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+            std::chrono::duration<double>(gap(rng)));
+    }
+    return rejected;
+}
+
+// Function to run a closed loop: each client sends its next job as soon as
+// the previous one completes; returns the number of rejected submissions
+long loadgen_closed(int clients, const char *dist, double seconds) {
+    std::atomic<long> rejected(0);
+    auto deadline = std::chrono::high_resolution_clock::now() +
+                    std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                        std::chrono::duration<double>(seconds));
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; c++) {
+        threads.push_back(std::thread([c, dist, deadline, &rejected] {
+            std::mt19937 rng(c + 1);
+            LoadSlot &slot = loadgen_slots[c];
+            slot.client = c;
+            while (std::chrono::high_resolution_clock::now() < deadline) {
+                {
+                    std::lock_guard<std::mutex> lock(loadgen_mutex);
+                    loadgen_client_done[c] = false;
+                }
+                slot.intended = std::chrono::high_resolution_clock::now();
+                if (!server_submit(loadgen_size(dist, rng), "loadgen", loadgen_done, &slot)) {
+                    rejected++;
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(loadgen_mutex);
+                loadgen_cv.wait(lock, [c] { return loadgen_client_done[c]; });
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    return rejected;
+}
+
+// Function to drive the server at each load level and print the
+// latency-vs-load curve. loop is "open" (levels are arrival rates in jobs/s)
+// or "closed" (levels are numbers of concurrent clients).
+void run_loadgen(const char *loop, const char *levels, const char *dist, double seconds) {
+    bool open = strcmp(loop, "closed") != 0;
+    loadgen_base_size = SZ;
+    server_quiet = true;
+    server_start();
+    loadgen_slots = (LoadSlot *)host_malloc(LOADGEN_MAX_SAMPLES * sizeof(LoadSlot));
+    loadgen_latencies = (double *)host_malloc(LOADGEN_MAX_SAMPLES * sizeof(double));
+
+    printf("%s loop, %s sizes around %d, %.1f s per level, %s backend\n", open ? "Open" : "Closed", dist, loadgen_base_size,
+           seconds, server_host_backend ? "host" : "OpenCL");
+    printf("%10s %10s %12s %9s %10s %10s %10s\n", open ? "rate/s" : "clients", "completed", "throughput/s",
+           "rejected", "p50 ms", "p99 ms", "p999 ms");
+
+    char list[256];
+    strncpy(list, levels, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    for (char *level = strtok(list, ","); level != NULL; level = strtok(NULL, ",")) {
+        double offered = atof(level);
+        if (offered <= 0 || (!open && offered > LOADGEN_MAX_CLIENTS)) {
+            printf("skipping load level %s\n", level);
+            continue;
+        }
+        loadgen_completed = 0;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        long rejected = open ? loadgen_open(offered, dist, seconds) : loadgen_closed((int)offered, dist, seconds);
+        server_wait_idle();
+        double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        long completed = loadgen_completed;
+        long n = completed < LOADGEN_MAX_SAMPLES ? completed : LOADGEN_MAX_SAMPLES;
+        printf("%10.0f %10ld %12.1f %9ld %10.3f %10.3f %10.3f\n", offered, completed, completed / elapsed,
+               rejected, percentile(loadgen_latencies, n, 0.50), percentile(loadgen_latencies, n, 0.99),
+               percentile(loadgen_latencies, n, 0.999));
+        fflush(stdout);
+    }
+
+    server_stop();
+    free(loadgen_slots);
+    free(loadgen_latencies);
+}
+
+// ---------------------------------------------------------------------------
+// Workload trace capture and replay
+// ---------------------------------------------------------------------------
+
+// Trace file: an 8-byte magic, then records each preceded by a tag byte.
+// 'T' records describe a tenant and are written before its first job and
+// whenever its weight or priority changes; 'J' records are jobs in
+// completion order, with their deadline and whether they finished.
+#define TRACE_MAGIC "VOPTRC02"
+#define TRACE_OP_ADD 0
+#define TRACE_TYPE_INT32 0
+#define TRACE_DEVICE_OPENCL 0
+#define TRACE_DEVICE_HOST 1
+#define TRACE_OUTCOME_COMPLETED 0
+#define TRACE_OUTCOME_CANCELLED 1
+#define TRACE_OUTCOME_DEADLINE 2
+
+struct TraceTenant {
+    char name[32];
+    cl_float weight;
+    cl_uchar index;
+    cl_uchar priority;
+    cl_uchar pad[2];
+};
+
+struct TraceJob {
+    cl_ulong arrival_ns;  // Submission time since the trace was opened
+    cl_uint size;
+    cl_uchar op, type, device, tenant;
+    cl_float service_ms;
+    cl_float latency_ms;
+    cl_float deadline_ms;  // After submission, 0 for none
+    cl_uint completed;     // Elements done before a cancel or the deadline stopped it
+    cl_uchar outcome;
+    cl_uchar pad[3];
+};
+
+FILE *trace_file = NULL;
+std::chrono::high_resolution_clock::time_point trace_start;
+double trace_weights[SERVER_MAX_TENANTS];  // Last weight written per tenant, 0 if none
+int trace_priorities[SERVER_MAX_TENANTS];
+
+// Function to start recording server jobs to the file named by TASK_TRACE
+void trace_open() {
+    const char *path = getenv("TASK_TRACE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("Couldn't open the trace file");
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 1, 8, trace_file);
+    memset(trace_weights, 0, sizeof(trace_weights));
+    trace_start = std::chrono::high_resolution_clock::now();
+}
+
+// Function to append one finished or stopped job; called with the server lock held
+void trace_job(const Job &job, int completed, double service_ms, double latency_ms) {
+    if (trace_file == NULL) {
+        return;
+    }
+    Tenant &tenant = tenants[job.tenant];
+    if (trace_weights[job.tenant] != tenant.weight || trace_priorities[job.tenant] != tenant.priority) {
+        TraceTenant record = {};
+        snprintf(record.name, sizeof(record.name), "%s", tenant.name);
+        record.weight = (cl_float)tenant.weight;
+        record.index = (cl_uchar)job.tenant;
+        record.priority = (cl_uchar)tenant.priority;
+        fputc('T', trace_file);
+        fwrite(&record, sizeof(record), 1, trace_file);
+        trace_weights[job.tenant] = tenant.weight;
+        trace_priorities[job.tenant] = tenant.priority;
+    }
+
+    TraceJob record = {};
+    record.arrival_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(job.submitted - trace_start).count();
+    record.size = (cl_uint)job.size;
+    record.op = TRACE_OP_ADD;
+    record.type = TRACE_TYPE_INT32;
+    record.device = server_host_backend ? TRACE_DEVICE_HOST : TRACE_DEVICE_OPENCL;
+    record.tenant = (cl_uchar)job.tenant;
+    record.service_ms = (cl_float)service_ms;
+    record.latency_ms = (cl_float)latency_ms;
+    if (job.deadline != std::chrono::high_resolution_clock::time_point::max()) {
+        record.deadline_ms = (cl_float)std::chrono::duration<double, std::milli>(job.deadline - job.submitted).count();
+    }
+    record.completed = (cl_uint)completed;
+    record.outcome = completed == job.size ? TRACE_OUTCOME_COMPLETED
+                     : job.cancelled || server_cancel_running ? TRACE_OUTCOME_CANCELLED
+                                                              : TRACE_OUTCOME_DEADLINE;
+    fputc('J', trace_file);
+    fwrite(&record, sizeof(record), 1, trace_file);
+}
+
+// Function to flush and close the trace
+void trace_close() {
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+// Function to re-issue a recorded trace through the server. "timed" keeps
+// the recorded inter-arrival times; "fast" submits each job as soon as its
+// tenant has queue space. Jobs keep their deadlines; a cancelled job replays
+// only the elements it did before the cancel. Prints recorded and replayed
+// latency side by side.
+void run_replay(const char *path, const char *pace) {
+    bool timed = strcmp(pace, "fast") != 0;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror("Couldn't open the trace file");
+        exit(1);
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 7) != 0) {
+        printf("%s is not a trace file\n", path);
+        exit(1);
+    }
+    if (memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        printf("%s is a version %.1s trace; this build reads version %.1s\n", path, magic + 7, TRACE_MAGIC + 7);
+        exit(1);
+    }
+
+    std::vector<TraceTenant> trace_tenants;
+    std::vector<TraceJob> jobs;
+    int tag;
+    while ((tag = fgetc(f)) != EOF) {
+        if (tag == 'T') {
+            TraceTenant record;
+            if (fread(&record, sizeof(record), 1, f) != 1) {
+                break;
+            }
+            record.name[sizeof(record.name) - 1] = '\0';
+            trace_tenants.push_back(record);
+        } else if (tag == 'J') {
+            TraceJob record;
+            if (fread(&record, sizeof(record), 1, f) != 1) {
+                break;
+            }
+            jobs.push_back(record);
+        } else {
+            printf("Corrupt trace record (tag %d)\n", tag);
+            exit(1);
+        }
+    }
+    fclose(f);
+    std::sort(jobs.begin(), jobs.end(),
+              [](const TraceJob &a, const TraceJob &b) { return a.arrival_ns < b.arrival_ns; });
+
+    // Tenant names by their index in the recording server
+    const char *names[SERVER_MAX_TENANTS];
+    for (int t = 0; t < SERVER_MAX_TENANTS; t++) {
+        names[t] = "default";
+    }
+    server_quiet = true;
+    server_start();
+    for (auto &record : trace_tenants) {
+        if (record.index < SERVER_MAX_TENANTS) {
+            names[record.index] = record.name;
+            server_configure_tenant(record.name, record.weight, record.priority);
+        }
+    }
+
+    long n = jobs.size() < LOADGEN_MAX_SAMPLES ? jobs.size() : LOADGEN_MAX_SAMPLES;
+    loadgen_slots = (LoadSlot *)host_malloc(LOADGEN_MAX_SAMPLES * sizeof(LoadSlot));
+    loadgen_latencies = (double *)host_malloc(LOADGEN_MAX_SAMPLES * sizeof(double));
+    loadgen_completed = 0;
+    std::vector<double> recorded(n);
+    double recorded_service_ms = 0;
+    long skipped = 0, recorded_stopped = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const TraceJob &record = jobs[i];
+        const char *name = record.tenant < SERVER_MAX_TENANTS ? names[record.tenant] : "default";
+        auto arrival = start + std::chrono::nanoseconds(record.arrival_ns);
+        if (timed) {
+            std::this_thread::sleep_until(arrival);
+        }
+        recorded[i % n] = record.latency_ms;
+        recorded_service_ms += record.service_ms;
+        int size = (int)record.size;
+        if (record.outcome != TRACE_OUTCOME_COMPLETED) {
+            recorded_stopped++;
+        }
+        if (record.outcome == TRACE_OUTCOME_CANCELLED) {
+            size = (int)record.completed;
+            if (size == 0) {
+                continue;
+            }
+        }
+
+        LoadSlot &slot = loadgen_slots[i % LOADGEN_MAX_SAMPLES];
+        slot.intended = timed ? arrival : std::chrono::high_resolution_clock::now();
+        slot.client = -1;
+        if (!server_submit(size, name, loadgen_done, &slot, record.deadline_ms)) {
+            // A full queue only delays the job; over-budget jobs are dropped
+            if (!server_wait_space(name, size)) {
+                skipped++;
+                continue;
+            }
+            if (!timed) {
+                slot.intended = std::chrono::high_resolution_clock::now();
+            }
+            server_submit(size, name, loadgen_done, &slot, record.deadline_ms);
+        }
+    }
+    server_wait_idle();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    server_stop();
+    long replayed_stopped = 0;
+    for (int t = 0; t < num_tenants; t++) {
+        replayed_stopped += tenants[t].stopped;
+    }
+
+    long replayed = loadgen_completed < LOADGEN_MAX_SAMPLES ? (long)loadgen_completed : LOADGEN_MAX_SAMPLES;
+    double span_ms = jobs.empty() ? 0 : (jobs.back().arrival_ns - jobs.front().arrival_ns) / 1e6;
+    printf("Replayed %zu jobs from %s (%s): %ld skipped, %.3f ms (recorded span %.3f ms, service %.3f ms)\n",
+           jobs.size(), path, timed ? "recorded inter-arrival times" : "as fast as possible", skipped, elapsed_ms,
+           span_ms, recorded_service_ms);
+    printf("Stopped by a cancel or deadline: %ld recorded, %ld replayed past their deadline\n", recorded_stopped,
+           replayed_stopped);
+    printf("%-10s %10s %10s %10s\n", "latency", "p50 ms", "p99 ms", "p999 ms");
+    printf("%-10s %10.3f %10.3f %10.3f\n", "recorded", percentile(recorded.data(), n, 0.50),
+           percentile(recorded.data(), n, 0.99), percentile(recorded.data(), n, 0.999));
+    printf("%-10s %10.3f %10.3f %10.3f\n", "replayed", percentile(loadgen_latencies, replayed, 0.50),
+           percentile(loadgen_latencies, replayed, 0.99), percentile(loadgen_latencies, replayed, 0.999));
+
+    free(loadgen_slots);
+    free(loadgen_latencies);
+}
+
+// ---------------------------------------------------------------------------
+// Host backend and lazy OpenCL loading
+// ---------------------------------------------------------------------------
+
+// Function to add two vectors on the host
+void vector_add_host(const int *a, const int *b, int *c, int size) {
+    add_host(a, b, c, size);
+}
+
+// Function to run the vector add on the host. No OpenCL call is made, so
+// libOpenCL is never loaded and no platform is initialized.
+void run_host() {
+    perf_begin("init");
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    perf_end();
+
+    perf_begin("print");
+    print(v1, SZ);
+    print(v2, SZ);
+    perf_end();
+
+    perf_begin("host add");
+    auto start = std::chrono::high_resolution_clock::now();
+    vector_add_host(v1, v2, v_out, SZ);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+    perf_end();
+
+    perf_begin("print output");
+    print(v_out, SZ);
+    perf_end();
+    printf("Host Execution Time: %f ms\n", elapsed_time.count());
+    perf_report();
+
+    free(v1);
+    free(v2);
+    free(v_out);
+}
+
+// The OpenCL entry points this program uses. The executable is not linked
+// against libOpenCL: each entry point below forwards to the library, which
+// is opened with dlopen on the first OpenCL call. Host-only runs skip the
+// ICD loader entirely. Set TASK_OPENCL_LIBRARY to load a specific library.
+#define OPENCL_LIBRARY "libOpenCL.so.1"
+
+#define OPENCL_FUNCTIONS(X) \
+    X(cl_int, clGetPlatformIDs, (cl_uint a, cl_platform_id *b, cl_uint *c), (a, b, c)) \
+    X(cl_int, clGetDeviceIDs, (cl_platform_id a, cl_device_type b, cl_uint c, cl_device_id *d, cl_uint *e), (a, b, c, d, e)) \
+    X(cl_int, clGetPlatformInfo, (cl_platform_id a, cl_platform_info b, size_t c, void *d, size_t *e), (a, b, c, d, e)) \
+    X(cl_int, clGetDeviceInfo, (cl_device_id a, cl_device_info b, size_t c, void *d, size_t *e), (a, b, c, d, e)) \
+    X(cl_int, clCreateSubDevices, (cl_device_id a, const cl_device_partition_property *b, cl_uint c, \
+        cl_device_id *d, cl_uint *e), (a, b, c, d, e)) \
+    X(cl_int, clReleaseDevice, (cl_device_id a), (a)) \
+    X(cl_context, clCreateContext, (const cl_context_properties *a, cl_uint b, const cl_device_id *c, \
+        void (CL_CALLBACK *d)(const char *, const void *, size_t, void *), void *e, cl_int *f), (a, b, c, d, e, f)) \
+    X(cl_int, clReleaseContext, (cl_context a), (a)) \
+    X(cl_command_queue, clCreateCommandQueueWithProperties, (cl_context a, cl_device_id b, \
+        const cl_queue_properties *c, cl_int *d), (a, b, c, d)) \
+    X(cl_int, clReleaseCommandQueue, (cl_command_queue a), (a)) \
+    X(cl_int, clGetMemObjectInfo, (cl_mem a, cl_mem_info b, size_t c, void *d, size_t *e), (a, b, c, d, e)) \
+    X(cl_program, clCreateProgramWithSource, (cl_context a, cl_uint b, const char **c, const size_t *d, cl_int *e), \
+        (a, b, c, d, e)) \
+    X(cl_int, clBuildProgram, (cl_program a, cl_uint b, const cl_device_id *c, const char *d, \
+        void (CL_CALLBACK *e)(cl_program, void *), void *f), (a, b, c, d, e, f)) \
+    X(cl_int, clGetProgramBuildInfo, (cl_program a, cl_device_id b, cl_program_build_info c, size_t d, void *e, \
+        size_t *f), (a, b, c, d, e, f)) \
+    X(cl_int, clRetainProgram, (cl_program a), (a)) \
+    X(cl_int, clReleaseProgram, (cl_program a), (a)) \
+    X(cl_kernel, clCreateKernel, (cl_program a, const char *b, cl_int *c), (a, b, c)) \
+    X(cl_int, clCreateKernelsInProgram, (cl_program a, cl_uint b, cl_kernel *c, cl_uint *d), (a, b, c, d)) \
+    X(cl_int, clGetKernelInfo, (cl_kernel a, cl_kernel_info b, size_t c, void *d, size_t *e), (a, b, c, d, e)) \
+    X(cl_int, clGetKernelWorkGroupInfo, (cl_kernel a, cl_device_id b, cl_kernel_work_group_info c, size_t d, \
+        void *e, size_t *f), (a, b, c, d, e, f)) \
+    X(cl_int, clSetKernelArg, (cl_kernel a, cl_uint b, size_t c, const void *d), (a, b, c, d)) \
+    X(cl_int, clReleaseKernel, (cl_kernel a), (a)) \
+    X(cl_int, clEnqueueNDRangeKernel, (cl_command_queue a, cl_kernel b, cl_uint c, const size_t *d, \
+        const size_t *e, const size_t *f, cl_uint g, const cl_event *h, cl_event *i), (a, b, c, d, e, f, g, h, i)) \
+    X(cl_int, clEnqueueReadBuffer, (cl_command_queue a, cl_mem b, cl_bool c, size_t d, size_t e, void *f, \
+        cl_uint g, const cl_event *h, cl_event *i), (a, b, c, d, e, f, g, h, i)) \
+    X(cl_int, clEnqueueWriteBuffer, (cl_command_queue a, cl_mem b, cl_bool c, size_t d, size_t e, const void *f, \
+        cl_uint g, const cl_event *h, cl_event *i), (a, b, c, d, e, f, g, h, i)) \
+    X(cl_int, clEnqueueMigrateMemObjects, (cl_command_queue a, cl_uint b, const cl_mem *c, cl_mem_migration_flags d, \
+        cl_uint e, const cl_event *f, cl_event *g), (a, b, c, d, e, f, g)) \
+    X(cl_int, clEnqueueFillBuffer, (cl_command_queue a, cl_mem b, const void *c, size_t d, size_t e, size_t f, \
+        cl_uint g, const cl_event *h, cl_event *i), (a, b, c, d, e, f, g, h, i)) \
+    X(cl_int, clEnqueueCopyBuffer, (cl_command_queue a, cl_mem b, cl_mem c, size_t d, size_t e, size_t f, \
+        cl_uint g, const cl_event *h, cl_event *i), (a, b, c, d, e, f, g, h, i)) \
+    X(void *, clEnqueueMapBuffer, (cl_command_queue a, cl_mem b, cl_bool c, cl_map_flags d, size_t e, size_t f, \
+        cl_uint g, const cl_event *h, cl_event *i, cl_int *j), (a, b, c, d, e, f, g, h, i, j)) \
+    X(cl_int, clEnqueueUnmapMemObject, (cl_command_queue a, cl_mem b, void *c, cl_uint d, const cl_event *e, \
+        cl_event *f), (a, b, c, d, e, f)) \
+    X(cl_int, clWaitForEvents, (cl_uint a, const cl_event *b), (a, b)) \
+    X(cl_int, clGetEventProfilingInfo, (cl_event a, cl_profiling_info b, size_t c, void *d, size_t *e), \
+        (a, b, c, d, e)) \
+    X(cl_int, clRetainEvent, (cl_event a), (a)) \
+    X(cl_int, clReleaseEvent, (cl_event a), (a)) \
+    X(cl_int, clSetEventCallback, (cl_event a, cl_int b, void (CL_CALLBACK *c)(cl_event, cl_int, void *), void *d), \
+        (a, b, c, d)) \
+    X(cl_int, clFinish, (cl_command_queue a), (a))
+
+// Entry points with hand-written forwarders below, which keep the device
+// allocation high-water mark
+#define OPENCL_TRACKED_FUNCTIONS(X) \
+    X(cl_mem, clCreateBuffer, (cl_context a, cl_mem_flags b, size_t c, void *d, cl_int *e), (a, b, c, d, e)) \
+    X(cl_int, clReleaseMemObject, (cl_mem a), (a))
+
+// Table of the library's entry points, filled in by load_opencl()
+struct OpenCLApi {
+#define OPENCL_POINTER(ret, name, params, args) ret (CL_API_CALL *name) params;
+    OPENCL_FUNCTIONS(OPENCL_POINTER)
+    OPENCL_TRACKED_FUNCTIONS(OPENCL_POINTER)
+#undef OPENCL_POINTER
+};
+OpenCLApi opencl_api;
+std::once_flag opencl_loaded;
+
+// Function to open the OpenCL library and resolve its entry points, once.
+// Returns whether they are available. The executable reports a missing
+// library or entry point and exits; libvecops must not end its host
+// process, so it returns false and vecops_engine_create() fails instead.
+bool load_opencl() {
+    static bool loaded = false;
+    std::call_once(opencl_loaded, [] {
+        const char *library = getenv("TASK_OPENCL_LIBRARY");
+        void *handle = dlopen(library ? library : OPENCL_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+        if (handle == NULL && library == NULL) {
+            handle = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+        }
+        if (handle == NULL) {
+#ifdef VECOPS_LIBRARY
+            return;
+#else
+            printf("Couldn't load the OpenCL library: %s\n", dlerror());
+            exit(1);
+#endif
+        }
+
+#ifdef VECOPS_LIBRARY
+#define OPENCL_MISSING(name) \
+            dlclose(handle); \
+            return;
+#else
+#define OPENCL_MISSING(name) \
+            printf("Couldn't find %s in the OpenCL library\n", #name); \
+            exit(1);
+#endif
+#define OPENCL_RESOLVE(ret, name, params, args) \
+        opencl_api.name = (ret (CL_API_CALL *) params)dlsym(handle, #name); \
+        if (opencl_api.name == NULL) { \
+            OPENCL_MISSING(name) \
+        }
+        OPENCL_FUNCTIONS(OPENCL_RESOLVE)
+        OPENCL_TRACKED_FUNCTIONS(OPENCL_RESOLVE)
+#undef OPENCL_RESOLVE
+#undef OPENCL_MISSING
+        loaded = true;
+    });
+    return loaded;
+}
+
+// Function to tell at compile time whether an entry point creates an OpenCL object
+constexpr bool opencl_creates_object(const char *name) {
+    return name[0] == 'c' && name[1] == 'l' && name[2] == 'C' && name[3] == 'r' && name[4] == 'e' &&
+           name[5] == 'a' && name[6] == 't' && name[7] == 'e';
+}
+
+// Function to tell at compile time whether two entry point names are the same
+constexpr bool opencl_name_is(const char *name, const char *other) {
+    return *name == *other && (*name == '\0' || opencl_name_is(name + 1, other + 1));
+}
+
+// Function to clear the event an entry point may hand back, so a failed
+// call is not counted as returning one
+template <typename... Args> void opencl_clear_events(Args... args) {
+    auto clear = [](auto arg) {
+        if constexpr (std::is_same<decltype(arg), cl_event *>::value) {
+            if (arg != NULL) {
+                *arg = NULL;
+            }
+        }
+    };
+    (clear(args), ...);
+}
+
+// Function to count the event an entry point handed back, if any
+template <typename... Args> void opencl_count_events(Args... args) {
+    auto count = [](auto arg) {
+        if constexpr (std::is_same<decltype(arg), cl_event *>::value) {
+            if (arg != NULL && *arg != NULL) {
+                cl_events_created++;
+                cl_event_references++;
+            }
+        }
+    };
+    (count(args), ...);
+}
+
+// Forwarding definitions of the OpenCL entry points
+#define OPENCL_FORWARD(ret, name, params, args) \
+    extern "C" CL_API_ENTRY ret CL_API_CALL name params { \
+        load_opencl(); \
+        if (opencl_creates_object(#name)) { \
+            cl_object_creations++; \
+        } else if (opencl_name_is(#name, "clRetainEvent")) { \
+            cl_event_references++; \
+        } else if (opencl_name_is(#name, "clReleaseEvent")) { \
+            cl_event_references--; \
+        } \
+        opencl_clear_events args; \
+        ret result = opencl_api.name args; \
+        opencl_count_events args; \
+        return result; \
+    }
+OPENCL_FUNCTIONS(OPENCL_FORWARD)
+#undef OPENCL_FORWARD
+
+extern "C" CL_API_ENTRY cl_mem CL_API_CALL clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
+                                                          void *host_ptr, cl_int *errcode_ret) {
+    load_opencl();
+    cl_object_creations++;
+    cl_mem mem = opencl_api.clCreateBuffer(context, flags, size, host_ptr, errcode_ret);
+    if (mem != NULL) {
+        long long bytes = device_bytes += size;
+        long long peak = device_bytes_peak;
+        while (bytes > peak && !device_bytes_peak.compare_exchange_weak(peak, bytes)) {
+        }
+    }
+    return mem;
+}
+
+extern "C" CL_API_ENTRY cl_int CL_API_CALL clReleaseMemObject(cl_mem mem) {
+    load_opencl();
+    // Only the last release frees the allocation
+    cl_uint refs = 0;
+    size_t size = 0;
+    if (mem != NULL && opencl_api.clGetMemObjectInfo(mem, CL_MEM_REFERENCE_COUNT, sizeof(refs), &refs, NULL) == CL_SUCCESS &&
+        refs == 1 && opencl_api.clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size), &size, NULL) == CL_SUCCESS) {
+        device_bytes -= size;
+    }
+    return opencl_api.clReleaseMemObject(mem);
+}
+
+// ---------------------------------------------------------------------------
+// Hardware performance counters for host phases
+// ---------------------------------------------------------------------------
+
+// Counters are collected when TASK_PERF is set in the environment. They are
+// opened as one perf_event group on the calling thread (user space only), so
+// every phase reads a consistent set. Bandwidth is estimated from LLC misses
+// times the cache line size; work on other threads is not counted.
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_DTLB_MISSES 3
+#define PERF_NUM_EVENTS 4
+#define PERF_MAX_PHASES 32
+#define PERF_LINE_SIZE 64
+
+// Counter values and wall time of one host phase
+struct PerfPhase {
+    const char *name;
+    double ms;
+    unsigned long long counts[PERF_NUM_EVENTS];
+    bool valid[PERF_NUM_EVENTS];
+};
+
+int perf_fds[PERF_NUM_EVENTS] = {-1, -1, -1, -1};
+int perf_state = 0;   // 0 = not opened yet, 1 = counting available, -1 = disabled
+PerfPhase perf_phases[PERF_MAX_PHASES];
+int perf_num_phases = 0;
+std::chrono::high_resolution_clock::time_point perf_start;
+
+// Function to open one counter, in the group led by group_fd (or as the leader)
+int perf_open(unsigned int type, unsigned long long config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;   // The leader starts and stops the group
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Function to open the counter group on first use; returns false when counting is off
+bool perf_setup() {
+    if (perf_state != 0) {
+        return perf_state > 0;
+    }
+    perf_state = -1;
+    if (getenv("TASK_PERF") == NULL) {
+        return false;
+    }
+
+    const unsigned long long cache_read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    perf_fds[PERF_CYCLES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_fds[PERF_CYCLES] < 0) {
+        perror("Couldn't open hardware counters (check perf_event_paranoid)");
+        return false;
+    }
+    int leader = perf_fds[PERF_CYCLES];
+    perf_fds[PERF_INSTRUCTIONS] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, leader);
+    perf_fds[PERF_LLC_MISSES] = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cache_read_miss, leader);
+    perf_fds[PERF_DTLB_MISSES] = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | cache_read_miss, leader);
+
+    perf_state = 1;
+    return true;
+}
+
+// Function to start counting a named host phase
+void perf_begin(const char *phase) {
+    if (!perf_setup() || perf_num_phases == PERF_MAX_PHASES) {
+        return;
+    }
+    perf_phases[perf_num_phases].name = phase;
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perf_start = std::chrono::high_resolution_clock::now();
+}
+
+// Function to stop counting the current phase and record its counts
+void perf_end() {
+    if (perf_state <= 0 || perf_num_phases == PERF_MAX_PHASES) {
+        return;
+    }
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed_time = stop - perf_start;
+
+    PerfPhase &p = perf_phases[perf_num_phases++];
+    p.ms = elapsed_time.count();
+
+    // Group read layout: nr, time_enabled, time_running, then {value, id} per event
+    unsigned long long data[3 + 2 * PERF_NUM_EVENTS];
+    memset(p.valid, 0, sizeof(p.valid));
+    if (read(perf_fds[PERF_CYCLES], data, sizeof(data)) < 0) {
+        return;
+    }
+    unsigned long long nr = data[0];
+    double scale = data[2] > 0 ? (double)data[1] / data[2] : 1.0; // Undo multiplexing
+
+    int slot = 0;
+    for (int e = 0; e < PERF_NUM_EVENTS && (unsigned long long)slot < nr; e++) {
+        if (perf_fds[e] < 0) {
+            continue; // Event unsupported on this machine
+        }
+        p.counts[e] = (unsigned long long)(data[3 + 2 * slot] * scale);
+        p.valid[e] = true;
+        slot++;
+    }
+}
+
+// Function to print the counters of every recorded phase
+void perf_report() {
+    if (perf_state <= 0) {
+        return;
+    }
+    printf("%-18s %10s %14s %14s %6s %12s %12s %8s\n",
+           "Phase", "ms", "cycles", "instructions", "IPC", "LLC-misses", "dTLB-misses", "~GB/s");
+    for (int i = 0; i < perf_num_phases; i++) {
+        PerfPhase &p = perf_phases[i];
+        printf("%-18s %10.3f", p.name, p.ms);
+        for (int e = PERF_CYCLES; e <= PERF_INSTRUCTIONS; e++) {
+            if (p.valid[e]) {
+                printf(" %14llu", p.counts[e]);
+            } else {
+                printf(" %14s", "n/a");
+            }
+        }
+        if (p.valid[PERF_CYCLES] && p.valid[PERF_INSTRUCTIONS] && p.counts[PERF_CYCLES] > 0) {
+            printf(" %6.2f", (double)p.counts[PERF_INSTRUCTIONS] / p.counts[PERF_CYCLES]);
+        } else {
+            printf(" %6s", "n/a");
+        }
+        for (int e = PERF_LLC_MISSES; e <= PERF_DTLB_MISSES; e++) {
+            if (p.valid[e]) {
+                printf(" %12llu", p.counts[e]);
+            } else {
+                printf(" %12s", "n/a");
+            }
+        }
+        if (p.valid[PERF_LLC_MISSES] && p.ms > 0) {
+            printf(" %8.2f\n", p.counts[PERF_LLC_MISSES] * (double)PERF_LINE_SIZE / (p.ms * 1e6));
+        } else {
+            printf(" %8s\n", "n/a");
+        }
+    }
+    perf_num_phases = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Strong and weak scaling report
+// ---------------------------------------------------------------------------
+
+#define SCALING_REPS 3        // Best of this many runs is reported
+#define SCALING_MAX_UNITS 8   // Devices or sub-devices tried at most
+
+// Function to add two vectors on the host, split into contiguous slices over threads
+void vector_add_threads(const int *a, const int *b, int *c, int size, int threads) {
+    std::vector<std::thread> workers;
+    long slice = (size + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        long begin = t * slice;
+        long len = begin + slice < size ? slice : size - begin;
+        if (len > 0) {
+            workers.push_back(std::thread([=] {
+                if (pin_threads) {
+                    pin_current_thread(t);
+                }
+                vector_add_host(a + begin, b + begin, c + begin, (int)len);
+            }));
+        }
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+// Function to time the threaded host add; returns the best of reps runs in ms
+double time_host_add(int size, int threads, int reps) {
+    double best = 0;
+    for (int r = 0; r < reps; r++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        vector_add_threads(v1, v2, v_out, size, threads);
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+        if (r == 0 || elapsed_time.count() < best) {
+            best = elapsed_time.count();
+        }
+    }
+    return best;
+}
+
+// Function to find up to max_units devices to scale over: the devices of the
+// chosen device's type on its platform, or, when there is only one, equal
+// sub-devices of it. Returns how many were found.
+int collect_scaling_devices(cl_device_id *devs, int max_units) {
+    cl_device_id dev = create_device();
+    cl_platform_id platform;
+    cl_device_type type;
+    cl_uint count = 0;
+
+    clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceIDs(platform, type, max_units, devs, &count);
+    if (count > 1) {
+        return count < (cl_uint)max_units ? count : max_units;
+    }
+
+    cl_uint compute_units = 1, max_sub = 0;
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub), &max_sub, NULL);
+    int parts = (int)max_sub < max_units ? (int)max_sub : max_units;
+    if (parts < 2 || compute_units < 2) {
+        devs[0] = dev;
+        return 1;
+    }
+
+    cl_device_partition_property props[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(compute_units / parts), 0};
+    if (clCreateSubDevices(dev, props, parts, devs, &count) < 0 || count == 0) {
+        devs[0] = dev;
+        return 1;
+    }
+    return count < (cl_uint)parts ? count : parts;
+}
+
+// Function to time write + vector_add_ocl + read of size elements split
+// evenly over the first units queues, each with its own slice buffers.
+// Returns the best of reps runs in ms. Each unit alternates between two sets
+// of buffers, and while one run works on one set, the other set is migrated
+// to the unit's device on its migrate_queues entry for the next run, so the
+// migration overlaps the work instead of stalling the next run's first
+// commands. migrate_ms gets the mean device time of one unit's migration.
+double time_device_add(cl_command_queue *queues, cl_command_queue *migrate_queues, int units, int size, int reps,
+                       double *migrate_ms) {
+    long slice = (size + units - 1) / units;
+    cl_mem bufs[SCALING_MAX_UNITS][2][3];
+    cl_event migrated[SCALING_MAX_UNITS][2];
+
+    for (int u = 0; u < units; u++) {
+        for (int set = 0; set < 2; set++) {
+            for (int b = 0; b < 3; b++) {
+                bufs[u][set][b] = clCreateBuffer(context, CL_MEM_READ_WRITE, slice * sizeof(int), NULL, &err);
+                check_error(err, "Couldn't create a buffer");
+            }
+        }
+    }
+
+    // No contents are kept: each run rewrites the inputs and the kernel
+    // overwrites the output. The first run's set has nothing to overlap with.
+    double migrate_total = 0;
+    for (int u = 0; u < units; u++) {
+        err = clEnqueueMigrateMemObjects(migrate_queues[u], 3, bufs[u][0], CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0,
+                                         NULL, &migrated[u][0]);
+        check_error(err, "Couldn't migrate the buffers");
+    }
+
+    double best = 0;
+    for (int r = 0; r < reps; r++) {
+        int set = r % 2;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int u = 0; u < units; u++) {
+            // The other set was last used by the previous run, which has finished
+            if (r + 1 < reps) {
+                err = clEnqueueMigrateMemObjects(migrate_queues[u], 3, bufs[u][1 - set],
+                                                 CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0, NULL,
+                                                 &migrated[u][1 - set]);
+                check_error(err, "Couldn't migrate the buffers");
+            }
+
+            long begin = u * slice;
+            int len = (int)(begin + slice < size ? slice : size - begin);
+            if (len <= 0) {
+                continue;
+            }
+            // Each command that first touches a migrated buffer waits for the migration
+            size_t global[1] = {(size_t)len};
+            cl_mem *b = bufs[u][set];
+            cl_event *ready = &migrated[u][set];
+            clEnqueueWriteBuffer(queues[u], b[0], CL_FALSE, 0, len * sizeof(int), v1 + begin, 1, ready, NULL);
+            clEnqueueWriteBuffer(queues[u], b[1], CL_FALSE, 0, len * sizeof(int), v2 + begin, 1, ready, NULL);
+
+            // Arguments are captured at enqueue time, so one kernel serves every queue
+            err = clSetKernelArg(kernel, 0, sizeof(int), (void *)&len);
+            err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&b[0]);
+            err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&b[1]);
+            err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&b[2]);
+            check_error(err, "Couldn't create a kernel argument");
+            err = clEnqueueNDRangeKernel(queues[u], kernel, 1, NULL, global, NULL, 1, ready, NULL);
+            check_error(err, "Couldn't enqueue the kernel");
+
+            clEnqueueReadBuffer(queues[u], b[2], CL_FALSE, 0, len * sizeof(int), v_out + begin, 0, NULL, NULL);
+        }
+        for (int u = 0; u < units; u++) {
+            clFinish(queues[u]);
+        }
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+        if (r == 0 || elapsed_time.count() < best) {
+            best = elapsed_time.count();
+        }
+
+        // This run's migrations are complete now that its commands are
+        for (int u = 0; u < units; u++) {
+            migrate_total += event_span_ms(migrated[u][set], migrated[u][set]);
+            clReleaseEvent(migrated[u][set]);
+        }
+    }
+    *migrate_ms = reps > 0 ? migrate_total / (reps * units) : 0;
+
+    for (int u = 0; u < units; u++) {
+        for (int set = 0; set < 2; set++) {
+            for (int b = 0; b < 3; b++) {
+                clReleaseMemObject(bufs[u][set][b]);
+            }
+        }
+    }
+    return best;
+}
+
+// Function to report strong scaling (fixed SZ) and weak scaling (SZ / N
+// elements per worker) for 1..N host threads and 1..N devices or sub-devices.
+// Weak scaling grows the problem up to SZ so memory use stays bounded.
+void run_scaling(int max_threads) {
+    if (max_threads <= 0) {
+        max_threads = (int)std::thread::hardware_concurrency();
+        max_threads = max_threads < 1 ? 1 : max_threads;
+    }
+
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+
+    // Host threads
+    printf("Host strong scaling, SZ = %d\n", SZ);
+    printf("%8s %12s %10s %12s\n", "threads", "ms", "speedup", "efficiency");
+    double base = time_host_add(SZ, 1, SCALING_REPS);
+    for (int t = 1; t <= max_threads; t++) {
+        double ms = t == 1 ? base : time_host_add(SZ, t, SCALING_REPS);
+        printf("%8d %12.3f %10.2f %11.1f%%\n", t, ms, base / ms, 100.0 * base / ms / t);
+    }
+
+    int per_thread = SZ / max_threads;
+    printf("Host weak scaling, %d elements per thread\n", per_thread);
+    printf("%8s %12s %12s %12s\n", "threads", "SZ", "ms", "efficiency");
+    base = time_host_add(per_thread, 1, SCALING_REPS);
+    for (int t = 1; t <= max_threads; t++) {
+        double ms = t == 1 ? base : time_host_add(per_thread * t, t, SCALING_REPS);
+        printf("%8d %12d %12.3f %11.1f%%\n", t, per_thread * t, ms, 100.0 * base / ms);
+    }
+
+    // Devices or sub-devices, sharing one context and program
+    cl_device_id devs[SCALING_MAX_UNITS];
+    cl_command_queue queues[SCALING_MAX_UNITS];
+    cl_command_queue migrate_queues[SCALING_MAX_UNITS];  // Profiled, for the timed migrations
+    int units = collect_scaling_devices(devs, SCALING_MAX_UNITS);
+
+    context = clCreateContext(NULL, units, devs, NULL, NULL, &err);
+    check_error(err, "Couldn't create a context");
+    for (int u = 0; u < units; u++) {
+        queues[u] = clCreateCommandQueueWithProperties(context, devs[u], 0, &err);
+        check_error(err, "Couldn't create a command queue");
+        cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+        migrate_queues[u] = clCreateCommandQueueWithProperties(context, devs[u], props, &err);
+        check_error(err, "Couldn't create a migration queue");
+    }
+    program = build_program(context, devs[0], "./vector_ops.txt");
+    kernel = create_kernel(program, "vector_add_ocl");
+
+    printf("Device strong scaling, SZ = %d, %d units\n", SZ, units);
+    printf("%8s %12s %10s %12s %12s\n", "units", "ms", "speedup", "efficiency", "migrate ms");
+    double migrate_ms, base_migrate_ms;
+    base = time_device_add(queues, migrate_queues, 1, SZ, SCALING_REPS, &base_migrate_ms);
+    for (int u = 1; u <= units; u++) {
+        double ms = u == 1 ? base : time_device_add(queues, migrate_queues, u, SZ, SCALING_REPS, &migrate_ms);
+        printf("%8d %12.3f %10.2f %11.1f%% %12.3f\n", u, ms, base / ms, 100.0 * base / ms / u,
+               u == 1 ? base_migrate_ms : migrate_ms);
+    }
+
+    int per_unit = SZ / units;
+    printf("Device weak scaling, %d elements per unit\n", per_unit);
+    printf("%8s %12s %12s %12s %12s\n", "units", "SZ", "ms", "efficiency", "migrate ms");
+    base = time_device_add(queues, migrate_queues, 1, per_unit, SCALING_REPS, &base_migrate_ms);
+    for (int u = 1; u <= units; u++) {
+        double ms = u == 1 ? base : time_device_add(queues, migrate_queues, u, per_unit * u, SCALING_REPS, &migrate_ms);
+        printf("%8d %12d %12.3f %11.1f%% %12.3f\n", u, per_unit * u, ms, 100.0 * base / ms,
+               u == 1 ? base_migrate_ms : migrate_ms);
+    }
+
+    for (int u = 0; u < units; u++) {
+        clReleaseCommandQueue(queues[u]);
+        clReleaseCommandQueue(migrate_queues[u]);
+        clReleaseDevice(devs[u]); // No-op for root devices
+    }
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseContext(context);
+    free(v1);
+    free(v2);
+    free(v_out);
+}
+
+// ---------------------------------------------------------------------------
+// Explain mode: predicted cost breakdown from a calibrated model
+// ---------------------------------------------------------------------------
+
+#define COST_MODEL_FILE "./cost_model.txt"
+#define COST_MODEL_WEIGHT 0.3  // Weight of a new measurement when refining the model
+#define CALIBRATION_SIZE (1 << 22)
+
+// Kernels that compute a vector add. The model keeps a kernel bandwidth for
+// each and plans with the one it predicts fastest.
+struct AddVariant {
+    const char *filename;
+    const char *kernelname;
+    const char *model_key;  // Its kernel bandwidth entry in the cost model file
+};
+
+#define NUM_ADD_VARIANTS 2
+AddVariant add_variants[NUM_ADD_VARIANTS] = {
+    {"./vector_ops.txt", "vector_add_ocl", "kernel_gbps"},
+    {ELEMENTWISE_SOURCE_NAME, "op_add", "op_add_gbps"},
+};
+
+// Linear cost model of one vector add: transfers and the kernel each cost a
+// fixed latency plus bytes over a bandwidth
+struct CostModel {
+    double write_gbps;                     // Host to device, both inputs
+    double kernel_gbps[NUM_ADD_VARIANTS];  // Bytes read and written by each add kernel
+    double read_gbps;                      // Device to host, the output
+    double latency_ms;                     // Per command
+    int samples;                           // Measurements folded in so far
+};
+
+// Uncalibrated defaults, roughly a PCIe 3 GPU
+CostModel cost_model = {8.0, {200.0, 200.0}, 8.0, 0.02, 0};
+
+// Function to read the cost model file, keeping the defaults for missing entries
+void load_cost_model() {
+    FILE *f = fopen(COST_MODEL_FILE, "r");
+    if (f == NULL) {
+        return;
+    }
+    char key[64];
+    double value;
+    while (fscanf(f, "%63s %lf", key, &value) == 2) {
+        if (strcmp(key, "write_gbps") == 0) cost_model.write_gbps = value;
+        else if (strcmp(key, "read_gbps") == 0) cost_model.read_gbps = value;
+        else if (strcmp(key, "latency_ms") == 0) cost_model.latency_ms = value;
+        else if (strcmp(key, "samples") == 0) cost_model.samples = (int)value;
+        for (int v = 0; v < NUM_ADD_VARIANTS; v++) {
+            if (strcmp(key, add_variants[v].model_key) == 0) cost_model.kernel_gbps[v] = value;
+        }
+    }
+    fclose(f);
+}
+
+// Function to write the cost model file
+void save_cost_model() {
+    FILE *f = fopen(COST_MODEL_FILE, "w");
+    if (f == NULL) {
+        perror("Couldn't write the cost model");
+        return;
+    }
+    fprintf(f, "write_gbps %f\n", cost_model.write_gbps);
+    for (int v = 0; v < NUM_ADD_VARIANTS; v++) {
+        fprintf(f, "%s %f\n", add_variants[v].model_key, cost_model.kernel_gbps[v]);
+    }
+    fprintf(f, "read_gbps %f\nlatency_ms %f\nsamples %d\n", cost_model.read_gbps, cost_model.latency_ms,
+            cost_model.samples);
+    fclose(f);
+}
+
+// Function to predict the time of a phase moving bytes at gbps
+double predict_ms(double bytes, double gbps) {
+    return cost_model.latency_ms + bytes / (gbps * 1e6);
+}
+
+// Function to return the device time from the start of one command to the
+// end of another, in ms, from their profiling events. The commands' queue
+// must have been created with CL_QUEUE_PROFILING_ENABLE.
+double event_span_ms(cl_event first, cl_event last) {
+    cl_ulong start = 0, end = 0;
+    err = clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    err |= clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    check_error(err, "Couldn't read the profiling information");
+    return end > start ? (end - start) / 1e6 : 0;
+}
+
+// Function to time the write, kernel and read phases of one add of size
+// elements with kernel k on the buffers set up by setup_kernel_memory().
+// The times are the device's own, so enqueue and wait overheads on the host
+// don't count against the phases.
+void measure_add(cl_kernel k, int size, double *write_ms, double *kernel_ms, double *read_ms) {
+    size_t global[1] = {(size_t)size};
+    cl_event written[2], ran, read;
+
+    err = clSetKernelArg(k, 0, sizeof(int), (void *)&size);
+    err |= clSetKernelArg(k, 1, sizeof(cl_mem), (void *)&bufV1);
+    err |= clSetKernelArg(k, 2, sizeof(cl_mem), (void *)&bufV2);
+    err |= clSetKernelArg(k, 3, sizeof(cl_mem), (void *)&bufV_out);
+    check_error(err, "Couldn't create a kernel argument");
+
+    err = clEnqueueWriteBuffer(queue, bufV1, CL_FALSE, 0, size * sizeof(int), v1, 0, NULL, &written[0]);
+    err |= clEnqueueWriteBuffer(queue, bufV2, CL_FALSE, 0, size * sizeof(int), v2, 0, NULL, &written[1]);
+    check_error(err, "Couldn't write the inputs");
+    err = clEnqueueNDRangeKernel(queue, k, 1, NULL, global, NULL, 0, NULL, &ran);
+    check_error(err, "Couldn't enqueue the kernel");
+    err = clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, size * sizeof(int), v_out, 0, NULL, &read);
+    check_error(err, "Couldn't read the output");
+
+    *write_ms = event_span_ms(written[0], written[1]);
+    *kernel_ms = event_span_ms(ran, ran);
+    *read_ms = event_span_ms(read, read);
+
+    clReleaseEvent(written[0]);
+    clReleaseEvent(written[1]);
+    clReleaseEvent(ran);
+    clReleaseEvent(read);
+}
+
+// Function to measure the fixed cost of one command, from an add of a
+// single element where the bytes moved don't matter
+double measure_latency(cl_kernel k) {
+    double write_ms, kernel_ms, read_ms;
+    measure_add(k, 1, &write_ms, &kernel_ms, &read_ms);
+    return (write_ms / 2 + kernel_ms + read_ms) / 3;
+}
+
+// Function to fold a measurement of size elements with an add variant into
+// the model. A weight of 1 replaces the bandwidths; smaller weights move
+// them part of the way.
+void update_cost_model(int variant, int size, double write_ms, double kernel_ms, double read_ms, double weight) {
+    double bytes = (double)size * sizeof(int);
+    double min_ms = 1e-6;
+    double write_gbps = 2 * bytes / ((write_ms - cost_model.latency_ms > min_ms ? write_ms - cost_model.latency_ms : min_ms) * 1e6);
+    double kernel_gbps = 3 * bytes / ((kernel_ms - cost_model.latency_ms > min_ms ? kernel_ms - cost_model.latency_ms : min_ms) * 1e6);
+    double read_gbps = bytes / ((read_ms - cost_model.latency_ms > min_ms ? read_ms - cost_model.latency_ms : min_ms) * 1e6);
+
+    cost_model.write_gbps += weight * (write_gbps - cost_model.write_gbps);
+    cost_model.kernel_gbps[variant] += weight * (kernel_gbps - cost_model.kernel_gbps[variant]);
+    cost_model.read_gbps += weight * (read_gbps - cost_model.read_gbps);
+    cost_model.samples++;
+}
+
+// Function to pick the add variant the model predicts fastest. Every variant
+// moves the same bytes, so that is the one with the highest kernel
+// bandwidth; ties go to the first.
+int choose_add_variant() {
+    int best = 0;
+    for (int v = 1; v < NUM_ADD_VARIANTS; v++) {
+        if (cost_model.kernel_gbps[v] > cost_model.kernel_gbps[best]) {
+            best = v;
+        }
+    }
+    return best;
+}
+
+// Function to print the execution plan of a vector add of size elements
+void print_plan(int size) {
+    char name[256] = "";
+    cl_ulong global_mem = 0, max_alloc = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+
+    double bytes = (double)size * sizeof(int);
+    int variant = choose_add_variant();
+    double write_ms = predict_ms(2 * bytes, cost_model.write_gbps);
+    double kernel_ms = predict_ms(3 * bytes, cost_model.kernel_gbps[variant]);
+    double read_ms = predict_ms(bytes, cost_model.read_gbps);
+
+    printf("Plan for SZ = %d\n", size);
+    printf("  device:       %s\n", name);
+    printf("  variant:      %s from %s\n", add_variants[variant].kernelname, add_variants[variant].filename);
+    for (int v = 0; v < NUM_ADD_VARIANTS; v++) {
+        if (v != variant) {
+            printf("  not chosen:   %s, kernel %.3f ms predicted\n", add_variants[v].kernelname,
+                   predict_ms(3 * bytes, cost_model.kernel_gbps[v]));
+        }
+    }
+    printf("  buffers:      3 x %.1f MB (%.1f MB total)\n", bytes / 1e6, 3 * bytes / 1e6);
+    printf("  device mem:   %.1f MB global, %.1f MB max allocation\n", global_mem / 1e6, max_alloc / 1e6);
+    // The host and device budgets, as the default mode plans them
+    int chunk = plan_chunk(host_memory_available(), global_mem, max_alloc);
+    printf("  fits:         %s\n", size <= chunk ? "yes" : "no");
+    if (chunk == 0) {
+        printf("  chunking:     impossible (not even %d elements fit)\n", MIN_STREAM_CHUNK);
+    } else {
+        long chunks = (size + (long)chunk - 1) / chunk;
+        printf("  chunking:     %s (%ld chunk(s) of up to %d elements)\n", chunks > 1 ? "required" : "none", chunks,
+               chunk);
+    }
+    printf("  predicted:    write %.3f ms, kernel %.3f ms, read %.3f ms, total %.3f ms\n",
+           write_ms, kernel_ms, read_ms, write_ms + kernel_ms + read_ms);
+    printf("  model:        %s (%d samples) from %s\n", cost_model.samples > 0 ? "calibrated" : "defaults",
+           cost_model.samples, COST_MODEL_FILE);
+}
+
+// Function to explain a vector add before running it. "calibrate" measures
+// every add variant to set the model, "run" also executes SZ with the
+// variant the plan chose and compares the prediction with the measurement,
+// refining the model either way.
+void run_explain(const char *action) {
+    bool calibrate = strcmp(action, "calibrate") == 0;
+    bool run = strcmp(action, "run") == 0;
+    load_cost_model();
+
+    setup_openCL_device_context_queue_kernel(add_variants[0].filename, add_variants[0].kernelname);
+    cl_kernel add_kernels[NUM_ADD_VARIANTS] = {kernel};
+
+    // run measures one full-size add, so a size that only fits in chunks is
+    // planned but not run
+    if (run) {
+        cl_ulong global_mem = 0, max_alloc = 0;
+        clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+        clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+        if (plan_chunk(host_memory_available(), global_mem, max_alloc) < SZ) {
+            print_plan(SZ);
+            printf("Can't run SZ = %d: three full vectors don't fit the host and device budgets; "
+                   "run it without explain to stream it in chunks\n", SZ);
+            exit(1);
+        }
+    }
+
+    if (calibrate || run) {
+        // Measurements come from profiling events, which need a profiling queue
+        clReleaseCommandQueue(queue);
+        cl_queue_properties props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+        queue = clCreateCommandQueueWithProperties(context, device_id, props, &err);
+        check_error(err, "Couldn't create a profiling queue");
+
+        for (int v = 1; v < NUM_ADD_VARIANTS; v++) {
+            cl_program variant_program = get_program(add_variants[v].filename, NULL);
+            add_kernels[v] = create_kernel(variant_program, add_variants[v].kernelname);
+            clReleaseProgram(variant_program);
+        }
+
+        // Buffers large enough for both the calibration and the full run
+        int size = run ? SZ : (SZ < CALIBRATION_SIZE ? SZ : CALIBRATION_SIZE);
+        int saved = SZ;
+        SZ = size;
+        init(v1, SZ);
+        init(v2, SZ);
+        init(v_out, SZ);
+        setup_kernel_memory();
+        SZ = saved;
+    }
+
+    double write_ms, kernel_ms, read_ms;
+    if (calibrate) {
+        int probe = SZ < CALIBRATION_SIZE ? SZ : CALIBRATION_SIZE;
+        for (int v = 0; v < NUM_ADD_VARIANTS; v++) {
+            measure_add(add_kernels[v], probe, &write_ms, &kernel_ms, &read_ms); // Warm-up
+        }
+        // Latency from a tiny add, bandwidths from the probe
+        cost_model.latency_ms = measure_latency(add_kernels[0]);
+        for (int v = 0; v < NUM_ADD_VARIANTS; v++) {
+            measure_add(add_kernels[v], probe, &write_ms, &kernel_ms, &read_ms);
+            update_cost_model(v, probe, write_ms, kernel_ms, read_ms, 1.0);
+        }
+        save_cost_model();
+    }
+
+    print_plan(SZ);
+
+    if (run) {
+        int variant = choose_add_variant();
+        double bytes = (double)SZ * sizeof(int);
+        double p_latency = cost_model.latency_ms;
+        double p_write = predict_ms(2 * bytes, cost_model.write_gbps);
+        double p_kernel = predict_ms(3 * bytes, cost_model.kernel_gbps[variant]);
+        double p_read = predict_ms(bytes, cost_model.read_gbps);
+        double latency_ms = measure_latency(add_kernels[variant]);
+        measure_add(add_kernels[variant], SZ, &write_ms, &kernel_ms, &read_ms);
+
+        printf("%-8s %12s %12s %8s\n", "phase", "predicted", "measured", "error");
+        printf("%-8s %12.3f %12.3f %7.1f%%\n", "latency", p_latency, latency_ms, 100 * (p_latency - latency_ms) / latency_ms);
+        printf("%-8s %12.3f %12.3f %7.1f%%\n", "write", p_write, write_ms, 100 * (p_write - write_ms) / write_ms);
+        printf("%-8s %12.3f %12.3f %7.1f%%\n", "kernel", p_kernel, kernel_ms, 100 * (p_kernel - kernel_ms) / kernel_ms);
+        printf("%-8s %12.3f %12.3f %7.1f%%\n", "read", p_read, read_ms, 100 * (p_read - read_ms) / read_ms);
+
+        // The latency is refined first, so the bandwidths are fitted to what remains
+        double weight = cost_model.samples > 0 ? COST_MODEL_WEIGHT : 1.0;
+        cost_model.latency_ms += weight * (latency_ms - cost_model.latency_ms);
+        update_cost_model(variant, SZ, write_ms, kernel_ms, read_ms, weight);
+        save_cost_model();
+    }
+
+    if (calibrate || run) {
+        for (int v = 1; v < NUM_ADD_VARIANTS; v++) {
+            clReleaseKernel(add_kernels[v]);
+        }
+        free_memory();
+    } else {
+        clReleaseKernel(kernel);
+        clReleaseCommandQueue(queue);
+        clReleaseProgram(program);
+        free_variants();
+        clReleaseContext(context);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// On-device input generation
+// ---------------------------------------------------------------------------
+
+#define RANDOM_RANGE 100  // Same range init() draws from
+
+// Kernels built from generate_ops.txt
+cl_program generate_program;
+cl_kernel iota_kernel, random_kernel;
+
+// Function to run the ten Philox4x32 rounds on counter c with key k, as the kernel does
+void philox4x32_10(unsigned int c[4], unsigned int k0, unsigned int k1) {
+    for (int round = 0; round < 10; round++) {
+        unsigned long long p0 = 0xD2511F53ull * c[0];
+        unsigned long long p1 = 0xCD9E8D57ull * c[2];
+        unsigned int hi0 = (unsigned int)(p0 >> 32), lo0 = (unsigned int)p0;
+        unsigned int hi1 = (unsigned int)(p1 >> 32), lo1 = (unsigned int)p1;
+        unsigned int next[4] = {hi1 ^ c[1] ^ k0, lo1, hi0 ^ c[3] ^ k1, lo0};
+        memcpy(c, next, sizeof(next));
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// Function to generate on the host the same random integers as random_ocl()
+void philox_fill(int *out, int n, unsigned long long seed, unsigned int stream, unsigned int range) {
+    for (long g = 0; 4 * g < n; g++) {
+        unsigned int c[4] = {(unsigned int)g, stream, 0, 0};
+        philox4x32_10(c, (unsigned int)seed, (unsigned int)(seed >> 32));
+        for (int j = 0; j < 4 && 4 * g + j < n; j++) {
+            out[4 * g + j] = (int)(c[j] % range);
+        }
+    }
+}
+
+// Function to generate on the host the same sequence as iota_ocl()
+void iota_fill(int *out, int n, int start) {
+    for (long i = 0; i < n; i++) {
+        out[i] = start + (int)i;
+    }
+}
+
+// Function to build the generation program and create its kernels
+void setup_generate_kernels() {
+    generate_program = get_program("./generate_ops.txt", NULL);
+    iota_kernel = create_kernel(generate_program, "iota_int");
+    random_kernel = create_kernel(generate_program, "random_int");
+}
+
+// Function to release the generation program and its kernels
+void free_generate_kernels() {
+    clReleaseKernel(iota_kernel);
+    clReleaseKernel(random_kernel);
+    clReleaseProgram(generate_program);
+}
+
+// Function to set n elements of a device buffer to value
+void fill_ocl(cl_mem buf, int n, int value) {
+    err = clEnqueueFillBuffer(queue, buf, &value, sizeof(int), 0, n * sizeof(int), 0, NULL, NULL);
+    check_error(err, "Couldn't fill the buffer");
+}
+
+// Function to write start, start + 1, ... to n elements of a device buffer
+void iota_ocl(cl_mem buf, int n, int start) {
+    size_t global[1] = {(size_t)n};
+    err = clSetKernelArg(iota_kernel, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(iota_kernel, 1, sizeof(int), (void *)&start);
+    err |= clSetKernelArg(iota_kernel, 2, sizeof(cl_mem), (void *)&buf);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, iota_kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the iota kernel");
+}
+
+// Function to fill n elements of a device buffer with random integers in
+// [0, range) from a seed; each stream is an independent sequence
+void random_ocl(cl_mem buf, int n, unsigned long long seed, unsigned int stream, unsigned int range) {
+    size_t global[1] = {(size_t)(n + 3) / 4};
+    unsigned int seed_lo = (unsigned int)seed;
+    unsigned int seed_hi = (unsigned int)(seed >> 32);
+    err = clSetKernelArg(random_kernel, 0, sizeof(int), (void *)&n);
+    err |= clSetKernelArg(random_kernel, 1, sizeof(unsigned int), (void *)&seed_lo);
+    err |= clSetKernelArg(random_kernel, 2, sizeof(unsigned int), (void *)&seed_hi);
+    err |= clSetKernelArg(random_kernel, 3, sizeof(unsigned int), (void *)&stream);
+    err |= clSetKernelArg(random_kernel, 4, sizeof(unsigned int), (void *)&range);
+    err |= clSetKernelArg(random_kernel, 5, sizeof(cl_mem), (void *)&buf);
+    check_error(err, "Couldn't create a kernel argument");
+    err = clEnqueueNDRangeKernel(queue, random_kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+    check_error(err, "Couldn't enqueue the random kernel");
+}
+
+// Function to run vector_add_ocl on inputs generated on the device ("random",
+// "iota" or "fill"), so no input data crosses the bus. The output is read
+// back and checked against the host generators.
+void run_generate(const char *kind, unsigned long long seed) {
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+    setup_generate_kernels();
+
+    bufV1 = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    bufV2 = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+    bufV_out = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &err);
+    check_error(err, "Couldn't create a buffer");
+
+    auto start = std::chrono::high_resolution_clock::now();
+    if (strcmp(kind, "iota") == 0) {
+        iota_ocl(bufV1, SZ, 0);
+        iota_ocl(bufV2, SZ, (int)seed);
+    } else if (strcmp(kind, "fill") == 0) {
+        fill_ocl(bufV1, SZ, (int)seed);
+        fill_ocl(bufV2, SZ, (int)seed);
+    } else {
+        random_ocl(bufV1, SZ, seed, 0, RANDOM_RANGE);
+        random_ocl(bufV2, SZ, seed, 1, RANDOM_RANGE);
+    }
+    clFinish(queue);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> generate_time = stop - start;
+
+    size_t global[1] = {(size_t)SZ};
+    copy_kernel_args();
+    start = std::chrono::high_resolution_clock::now();
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+    clFinish(queue);
+    stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> kernel_time = stop - start;
+
+    // Host generators give the same inputs bit for bit
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    if (strcmp(kind, "iota") == 0) {
+        iota_fill(v1, SZ, 0);
+        iota_fill(v2, SZ, (int)seed);
+    } else if (strcmp(kind, "fill") == 0) {
+        std::fill(v1, v1 + SZ, (int)seed);
+        std::fill(v2, v2 + SZ, (int)seed);
+    } else {
+        philox_fill(v1, SZ, seed, 0, RANDOM_RANGE);
+        philox_fill(v2, SZ, seed, 1, RANDOM_RANGE);
+    }
+    clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), v_out, 0, NULL, NULL);
+
+    long mismatches = 0;
+    for (long i = 0; i < SZ; i++) {
+        mismatches += (v_out[i] != v1[i] + v2[i]);
+    }
+
+    print(v_out, SZ);
+    printf("Generate (%s): %f ms, Kernel Execution Time: %f ms, mismatches %ld\n",
+           kind, generate_time.count(), kernel_time.count(), mismatches);
+
+    free_generate_kernels();
+    free_memory();
+}
+
+// ---------------------------------------------------------------------------
+// Device capabilities and recommended configuration
+// ---------------------------------------------------------------------------
+
+#define CONFIG_MAX_LOCAL 256         // Larger work-groups rarely help a streaming kernel
+#define CONFIG_CHUNK_BYTES (4 << 20) // Per operand; amortizes the per-enqueue overhead
+
+// Settings derived from the device, used by the pipeline's device stages
+struct DeviceConfig {
+    int chunk;          // Elements per chunk for streamed execution
+    size_t local_size;  // Work-group size for vector_add_ocl, 0 to let the runtime pick
+};
+
+DeviceConfig device_config;
+bool device_config_ready = false;
+
+// Function to derive the recommended settings from the device and, when
+// given, the compiled vector_add_ocl kernel; computed once
+DeviceConfig recommended_config(cl_kernel k) {
+    if (device_config_ready) {
+        return device_config;
+    }
+    cl_device_id dev = create_device();
+    cl_uint compute_units = 1;
+    size_t max_group = 1;
+    cl_ulong global_mem = 0, max_alloc = 0;
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+
+    // Local size: the largest multiple of the kernel's preferred multiple
+    // the kernel allows, up to CONFIG_MAX_LOCAL
+    size_t local = std::min(max_group, (size_t)CONFIG_MAX_LOCAL);
+    if (k != NULL) {
+        size_t kernel_group = local, multiple = 1;
+        clGetKernelWorkGroupInfo(k, dev, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_group), &kernel_group, NULL);
+        clGetKernelWorkGroupInfo(k, dev, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple,
+                                 NULL);
+        local = std::min(local, kernel_group);
+        if (multiple > 0 && local >= multiple) {
+            local -= local % multiple;
+        }
+    }
+
+    // Chunk: CONFIG_CHUNK_BYTES per operand but at least 64 work-groups per
+    // compute unit, within one allocation and 80% of global memory for the
+    // three buffers; a multiple of the local size
+    cl_ulong chunk = CONFIG_CHUNK_BYTES / sizeof(int);
+    chunk = std::max(chunk, (cl_ulong)compute_units * local * 64);
+    chunk = std::min(chunk, max_alloc / sizeof(int));
+    chunk = std::min(chunk, (cl_ulong)(global_mem * MEMORY_FRACTION) / (3 * sizeof(int)));
+    chunk = std::min(chunk, (cl_ulong)INT_MAX);
+    chunk -= chunk % local;
+
+    device_config.chunk = (int)std::max(chunk, (cl_ulong)local);
+    device_config.local_size = local;
+    device_config_ready = true;
+    return device_config;
+}
+
+// Function to print the work-group limits of every kernel in a registered variant
+void inspect_variant(int id) {
+    start_variant_builds(id);
+    std::unique_lock<std::mutex> lock(variant_mutex);
+    variant_cv.wait(lock, [id] { return variants[id].status != VARIANT_PENDING; });
+    const char *options = variants[id].options != NULL ? variants[id].options : "";
+    if (variants[id].status == VARIANT_FAILED) {
+        printf("  %s %s: not built (%s)\n", variants[id].filename, options, variants[id].log);
+        return;
+    }
+    cl_program prog = variants[id].program;
+    lock.unlock();
+
+    cl_uint num_kernels = 0;
+    clCreateKernelsInProgram(prog, 0, NULL, &num_kernels);
+    std::vector<cl_kernel> kernels(num_kernels);
+    clCreateKernelsInProgram(prog, num_kernels, kernels.data(), NULL);
+    for (cl_kernel k : kernels) {
+        char name[128] = "";
+        size_t group = 0, multiple = 0;
+        cl_ulong private_mem = 0, local_mem = 0;
+        clGetKernelInfo(k, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+        clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(group), &group, NULL);
+        clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple),
+                                 &multiple, NULL);
+        clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(private_mem), &private_mem, NULL);
+        clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+        printf("  %-28s %-12s %8zu %9zu %9llu %9llu\n", name, options, group, multiple,
+               (unsigned long long)private_mem, (unsigned long long)local_mem);
+        clReleaseKernel(k);
+    }
+}
+
+// Function to dump the device's limits, the limits of every compiled
+// kernel, and the recommended configuration
+void run_inspect() {
+    setup_openCL_device_context_queue();
+
+    char text[1024];
+    clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(text), text, NULL);
+    printf("Device:                 %s\n", text);
+    clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(text), text, NULL);
+    printf("Version:                %s\n", text);
+    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(text), text, NULL);
+    printf("Driver:                 %s\n", text);
+
+    cl_uint compute_units = 0, clock = 0, dims = 0;
+    size_t max_group = 0, item_sizes[3] = {0, 0, 0};
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock), &clock, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(dims), &dims, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(item_sizes), item_sizes, NULL);
+    printf("Compute units:          %u at %u MHz\n", compute_units, clock);
+    printf("Max work-group size:    %zu (items %zu x %zu x %zu)\n", max_group, item_sizes[0], item_sizes[1],
+           item_sizes[2]);
+
+    cl_ulong global_mem = 0, max_alloc = 0, local_mem = 0, cache = 0;
+    cl_uint cache_line = 0;
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, sizeof(cache), &cache, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, sizeof(cache_line), &cache_line, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+    printf("Global memory:          %.1f MB (max allocation %.1f MB)%s\n", global_mem / (1024.0 * 1024),
+           max_alloc / (1024.0 * 1024), unified ? ", shared with the host" : "");
+    printf("Local memory:           %.1f KB\n", local_mem / 1024.0);
+    printf("Global cache:           %.1f KB, %u-byte lines\n", cache / 1024.0, cache_line);
+
+    const cl_device_info widths[] = {CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT,
+                                     CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+                                     CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE};
+    printf("Preferred vector width: ");
+    const char *type_names[] = {"char", "short", "int", "long", "float", "double"};
+    for (int w = 0; w < 6; w++) {
+        cl_uint width = 0;
+        clGetDeviceInfo(device_id, widths[w], sizeof(width), &width, NULL);
+        printf("%s%s %u", w > 0 ? ", " : "", type_names[w], width);
+    }
+    printf("\n");
+
+    cl_device_svm_capabilities svm = 0;
+    if (clGetDeviceInfo(device_id, CL_DEVICE_SVM_CAPABILITIES, sizeof(svm), &svm, NULL) != CL_SUCCESS) {
+        svm = 0;
+    }
+    printf("SVM:                    %s%s%s%s%s\n", svm == 0 ? "none" : "",
+           svm & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER ? "coarse-grain buffer " : "",
+           svm & CL_DEVICE_SVM_FINE_GRAIN_BUFFER ? "fine-grain buffer " : "",
+           svm & CL_DEVICE_SVM_FINE_GRAIN_SYSTEM ? "fine-grain system " : "",
+           svm & CL_DEVICE_SVM_ATOMICS ? "atomics" : "");
+
+    cl_uint max_sub = 0;
+    cl_device_partition_property partitions[8] = {0};
+    size_t partition_bytes = 0;
+    clGetDeviceInfo(device_id, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub), &max_sub, NULL);
+    clGetDeviceInfo(device_id, CL_DEVICE_PARTITION_PROPERTIES, sizeof(partitions), partitions, &partition_bytes);
+    printf("Sub-devices:            up to %u%s%s\n", max_sub,
+           std::find(partitions, partitions + 8, CL_DEVICE_PARTITION_EQUALLY) != partitions + 8 ? ", equally" : "",
+           std::find(partitions, partitions + 8, CL_DEVICE_PARTITION_BY_COUNTS) != partitions + 8 ? ", by counts" : "");
+
+    printf("\nKernels (work-group size, preferred multiple, private and local bytes):\n");
+    printf("  %-28s %-12s %8s %9s %9s %9s\n", "kernel", "options", "group", "multiple", "private", "local");
+    for (int id = 0; id < num_variants; id++) {
+        inspect_variant(id);
+    }
+
+    // The recommendation uses vector_add_ocl's limits when it builds
+    cl_kernel k = NULL;
+    int id = find_variant("./vector_ops.txt", NULL);
+    std::unique_lock<std::mutex> lock(variant_mutex);
+    if (variants[id].status == VARIANT_READY) {
+        k = clCreateKernel(variants[id].program, "vector_add_ocl", &err);
+    }
+    lock.unlock();
+    DeviceConfig config = recommended_config(k);
+    if (k != NULL) {
+        clReleaseKernel(k);
+    }
+    printf("\nRecommended: chunk %d elements, local size %zu\n", config.chunk, config.local_size);
+
+    free_variants();
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+}
+
+// ---------------------------------------------------------------------------
+// Streaming pipeline
+// ---------------------------------------------------------------------------
+
+#define PIPELINE_MAX_STAGES 8
+#define PIPELINE_QUEUE_CAPACITY 64  // Power of two, larger than any pool depth
+#define PIPELINE_END -1             // Chunk index that tells a stage its input is done
+
+enum { STAGE_GEN, STAGE_FILE, STAGE_DEVICE, STAGE_HOST, STAGE_VERIFY, STAGE_PRINT, STAGE_NULL };
+const char *stage_names[] = {"gen", "file", "device", "host", "verify", "print", "null"};
+
+// A chunk of the SZ-element job; a and b point into the pool or a mapped file
+struct Chunk {
+    long offset;
+    int count;
+    int *a, *b, *out;
+};
+
+// Bounded lock-free queue of chunk indices with one producer and one consumer
+struct ChunkQueue {
+    int slots[PIPELINE_QUEUE_CAPACITY];
+    std::atomic<unsigned> head;  // Next slot to pop, written by the consumer
+    std::atomic<unsigned> tail;  // Next slot to push, written by the producer
+};
+
+struct Stage {
+    int kind;
+    char arg[256];
+    ChunkQueue *in, *out;
+    double busy_ms;
+    long mismatches;
+    cl_command_queue queue;  // Device stages: own queue, kernel and buffers
+    cl_kernel kernel;
+    cl_mem buf_a, buf_b, buf_out;
+    int fd;                  // File stages
+    int *map;
+    int index_fd;            // File sinks: completion index next to the output
+    int head[3][5], tail[3][5];  // print:summary: ends of a, b and out
+    struct random_data rand_a, rand_b;  // gen:rand: rand()'s sequence for a and b
+    char rand_state[2][128];
+};
+
+// Completion index written to <output>.idx by a file sink. completed only
+// grows, and every element before it is already in the output file.
+// stopped is set when the pipeline stops early; completed is then final.
+struct CompletionIndex {
+    cl_ulong total;
+    cl_ulong completed;
+    cl_ulong stopped;
+};
+
+Chunk pipeline_chunks[PIPELINE_QUEUE_CAPACITY];
+ChunkQueue pipeline_queues[PIPELINE_MAX_STAGES];  // Queue i feeds stage i + 1
+ChunkQueue pipeline_free;                          // Finished chunks back to the source
+Stage stages[PIPELINE_MAX_STAGES];
+int num_stages = 0;
+int pipeline_chunk = 0;
+
+// Progressive delivery: the last stage publishes each chunk as it finishes.
+// Chunks pass every stage in order, so completed output is always a prefix.
+void (*pipeline_on_chunk)(long offset, int count, const int *out, void *arg) = NULL;
+void *pipeline_on_chunk_arg = NULL;
+std::atomic<long> pipeline_completed(0);  // Elements of output ready
+double pipeline_first_ms = 0;             // When the first chunk was ready
+std::chrono::high_resolution_clock::time_point pipeline_start;
+
+// Cancellation: the source stops taking chunks once SIGINT arrives or the
+// deadline (TASK_DEADLINE_MS) passes; chunks already in flight drain
+std::atomic<bool> pipeline_cancel(false);
+std::chrono::high_resolution_clock::time_point pipeline_deadline;
+
+// Function to push a chunk index; false if the queue is full
+bool chunk_queue_push(ChunkQueue &q, int chunk) {
+    unsigned t = q.tail.load(std::memory_order_relaxed);
+    if (t - q.head.load(std::memory_order_acquire) == PIPELINE_QUEUE_CAPACITY) {
+        return false;
+    }
+    q.slots[t % PIPELINE_QUEUE_CAPACITY] = chunk;
+    q.tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+// Function to pop a chunk index; false if the queue is empty
+bool chunk_queue_pop(ChunkQueue &q, int *chunk) {
+    unsigned h = q.head.load(std::memory_order_relaxed);
+    if (h == q.tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    *chunk = q.slots[h % PIPELINE_QUEUE_CAPACITY];
+    q.head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+// Blocking versions: a stage waits here when its neighbour is behind
+void chunk_queue_put(ChunkQueue &q, int chunk) {
+    while (!chunk_queue_push(q, chunk)) {
+        std::this_thread::yield();
+    }
+}
+int chunk_queue_take(ChunkQueue &q) {
+    int chunk;
+    while (!chunk_queue_pop(q, &chunk)) {
+        std::this_thread::yield();
+    }
+    return chunk;
+}
+
+// Function to parse "kind[:arg]" into the next stage
+void add_stage(const char *spec) {
+    if (num_stages == PIPELINE_MAX_STAGES) {
+        printf("Too many pipeline stages (at most %d)\n", PIPELINE_MAX_STAGES);
+        exit(1);
+    }
+    Stage &stage = stages[num_stages];
+    memset(&stage, 0, sizeof(stage));
+    stage.fd = -1;
+    stage.index_fd = -1;
+    const char *colon = strchr(spec, ':');
+    size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+    stage.kind = -1;
+    for (int k = 0; k <= STAGE_NULL; k++) {
+        if (strlen(stage_names[k]) == len && strncmp(spec, stage_names[k], len) == 0) {
+            stage.kind = k;
+        }
+    }
+    if (stage.kind < 0) {
+        printf("Unknown pipeline stage %s\n", spec);
+        exit(1);
+    }
+    snprintf(stage.arg, sizeof(stage.arg), "%s", colon != NULL ? colon + 1 : "");
+    num_stages++;
+}
+
+// Function to acquire what a stage needs before the pipeline starts
+void open_stage(Stage &stage, bool first) {
+    if (stage.kind == STAGE_GEN && !first) {
+        printf("gen can only be the first stage\n");
+        exit(1);
+    }
+    if (first && stage.kind != STAGE_GEN && stage.kind != STAGE_FILE) {
+        printf("The first stage must be gen or file:<path>\n");
+        exit(1);
+    }
+    if (stage.kind == STAGE_GEN && strcmp(stage.arg, "rand") == 0) {
+        // init(v1, SZ) then init(v2, SZ) draw rand() from its default seed,
+        // so a follows that sequence and b the same one SZ draws later
+        int32_t skip;
+        initstate_r(1, stage.rand_state[0], sizeof(stage.rand_state[0]), &stage.rand_a);
+        initstate_r(1, stage.rand_state[1], sizeof(stage.rand_state[1]), &stage.rand_b);
+        for (long i = 0; i < SZ; i++) {
+            random_r(&stage.rand_b, &skip);
+        }
+    }
+    if (stage.kind == STAGE_FILE && first) {
+        // Input file: SZ ints of a followed by SZ ints of b, mapped rather than read
+        stage.fd = open(stage.arg, O_RDONLY);
+        struct stat st;
+        if (stage.fd < 0 || fstat(stage.fd, &st) != 0) {
+            perror("Couldn't open the pipeline input");
+            exit(1);
+        }
+        if ((size_t)st.st_size < 2 * (size_t)SZ * sizeof(int)) {
+            printf("%s holds %ld bytes, %zu needed for two vectors of %d ints\n", stage.arg, (long)st.st_size,
+                   2 * (size_t)SZ * sizeof(int), SZ);
+            exit(1);
+        }
+        stage.map = (int *)mmap(NULL, 2 * (size_t)SZ * sizeof(int), PROT_READ, MAP_PRIVATE, stage.fd, 0);
+        if (stage.map == MAP_FAILED) {
+            perror("Couldn't map the pipeline input");
+            exit(1);
+        }
+    } else if (stage.kind == STAGE_FILE) {
+        stage.fd = open(stage.arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stage.fd < 0 || ftruncate(stage.fd, (off_t)SZ * sizeof(int)) != 0) {
+            perror("Couldn't create the pipeline output");
+            exit(1);
+        }
+        char index_path[300];
+        snprintf(index_path, sizeof(index_path), "%s.idx", stage.arg);
+        stage.index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CompletionIndex index = {(cl_ulong)SZ, 0, 0};
+        if (stage.index_fd < 0 || pwrite(stage.index_fd, &index, sizeof(index), 0) != sizeof(index)) {
+            perror("Couldn't create the completion index");
+            exit(1);
+        }
+    } else if (stage.kind == STAGE_DEVICE) {
+        if (context == NULL) {
+            setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+        }
+        stage.queue = clCreateCommandQueueWithProperties(context, device_id, 0, &err);
+        check_error(err, "Couldn't create a pipeline queue");
+        stage.kernel = create_kernel(program, "vector_add_ocl");
+        recommended_config(stage.kernel);
+        stage.buf_a = clCreateBuffer(context, CL_MEM_READ_ONLY, pipeline_chunk * sizeof(int), NULL, &err);
+        stage.buf_b = clCreateBuffer(context, CL_MEM_READ_ONLY, pipeline_chunk * sizeof(int), NULL, &err);
+        stage.buf_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, pipeline_chunk * sizeof(int), NULL, &err);
+        check_error(err, "Couldn't create the pipeline buffers");
+    }
+}
+
+// Function to release a stage's resources
+void close_stage(Stage &stage) {
+    if (stage.map != NULL) {
+        munmap(stage.map, 2 * (size_t)SZ * sizeof(int));
+    }
+    if (stage.fd >= 0) {
+        close(stage.fd);
+    }
+    if (stage.index_fd >= 0) {
+        close(stage.index_fd);
+    }
+    if (stage.kind == STAGE_DEVICE) {
+        clReleaseMemObject(stage.buf_a);
+        clReleaseMemObject(stage.buf_b);
+        clReleaseMemObject(stage.buf_out);
+        clReleaseKernel(stage.kernel);
+        clReleaseCommandQueue(stage.queue);
+    }
+}
+
+// Function to do one stage's work on one chunk
+void process_chunk(Stage &stage, Chunk &chunk, long index) {
+    switch (stage.kind) {
+    case STAGE_GEN:
+        // One Philox stream per chunk and operand, so chunks are independent
+        if (strcmp(stage.arg, "iota") == 0) {
+            iota_fill(chunk.a, chunk.count, (int)chunk.offset);
+            iota_fill(chunk.b, chunk.count, (int)chunk.offset);
+        } else if (strcmp(stage.arg, "rand") == 0) {
+            // The values init() would have put in v1 and v2
+            for (int i = 0; i < chunk.count; i++) {
+                int32_t x, y;
+                random_r(&stage.rand_a, &x);
+                random_r(&stage.rand_b, &y);
+                chunk.a[i] = x % 100;
+                chunk.b[i] = y % 100;
+            }
+        } else {
+            philox_fill(chunk.a, chunk.count, 1, 2 * (unsigned int)index, RANDOM_RANGE);
+            philox_fill(chunk.b, chunk.count, 1, 2 * (unsigned int)index + 1, RANDOM_RANGE);
+        }
+        break;
+    case STAGE_FILE:
+        if (stage.map != NULL) {
+            chunk.a = stage.map + chunk.offset;
+            chunk.b = stage.map + SZ + chunk.offset;
+        } else {
+            // The data goes out before the index that covers it
+            cl_ulong completed = chunk.offset + chunk.count;
+            if (pwrite(stage.fd, chunk.out, chunk.count * sizeof(int), chunk.offset * sizeof(int)) < 0 ||
+                pwrite(stage.index_fd, &completed, sizeof(completed), offsetof(CompletionIndex, completed)) < 0) {
+                perror("Couldn't write the pipeline output");
+                exit(1);
+            }
+        }
+        break;
+    case STAGE_DEVICE: {
+        size_t global[1] = {(size_t)chunk.count};
+        size_t local[1] = {device_config.local_size};
+        bool use_local = local[0] > 0 && chunk.count % local[0] == 0;
+        clEnqueueWriteBuffer(stage.queue, stage.buf_a, CL_FALSE, 0, chunk.count * sizeof(int), chunk.a, 0, NULL, NULL);
+        clEnqueueWriteBuffer(stage.queue, stage.buf_b, CL_FALSE, 0, chunk.count * sizeof(int), chunk.b, 0, NULL, NULL);
+        err = clSetKernelArg(stage.kernel, 0, sizeof(int), (void *)&chunk.count);
+        err |= clSetKernelArg(stage.kernel, 1, sizeof(cl_mem), (void *)&stage.buf_a);
+        err |= clSetKernelArg(stage.kernel, 2, sizeof(cl_mem), (void *)&stage.buf_b);
+        err |= clSetKernelArg(stage.kernel, 3, sizeof(cl_mem), (void *)&stage.buf_out);
+        check_error(err, "Couldn't create a kernel argument");
+        err = clEnqueueNDRangeKernel(stage.queue, stage.kernel, 1, NULL, global, use_local ? local : NULL, 0, NULL,
+                                     NULL);
+        check_error(err, "Couldn't enqueue the kernel");
+        clEnqueueReadBuffer(stage.queue, stage.buf_out, CL_TRUE, 0, chunk.count * sizeof(int), chunk.out, 0, NULL,
+                            NULL);
+        break;
+    }
+    case STAGE_HOST:
+        vector_add_host(chunk.a, chunk.b, chunk.out, chunk.count);
+        break;
+    case STAGE_VERIFY:
+        for (int i = 0; i < chunk.count; i++) {
+            stage.mismatches += (chunk.out[i] != chunk.a[i] + chunk.b[i]);
+        }
+        break;
+    case STAGE_PRINT:
+        if (strcmp(stage.arg, "summary") == 0 && SZ > 15) {
+            // Keep the first and last five elements for print_summary()
+            int *parts[3] = {chunk.a, chunk.b, chunk.out};
+            long end = chunk.offset + chunk.count;
+            for (int p = 0; p < 3; p++) {
+                for (long pos = chunk.offset; pos < std::min(end, 5L); pos++) {
+                    stage.head[p][pos] = parts[p][pos - chunk.offset];
+                }
+                for (long pos = std::max(chunk.offset, (long)SZ - 5); pos < end; pos++) {
+                    stage.tail[p][pos - (SZ - 5)] = parts[p][pos - chunk.offset];
+                }
+            }
+        } else {
+            print(chunk.out, chunk.count);
+        }
+        break;
+    }
+}
+
+// Function to print the ends of a, b and out kept by a print:summary stage,
+// in the format print() uses for a whole vector
+void print_summary(Stage &stage) {
+    if (PRINT == 0 || stage.kind != STAGE_PRINT || strcmp(stage.arg, "summary") != 0 || SZ <= 15) {
+        return;
+    }
+    for (int p = 0; p < 3; p++) {
+        for (int i = 0; i < 5; i++) {
+            printf("%d ", stage.head[p][i]);
+        }
+        printf(" ..... ");
+        if (pipeline_completed == SZ) {
+            for (int i = 0; i < 5; i++) {
+                printf("%d ", stage.tail[p][i]);
+            }
+        }
+        printf("\n----------------------------\n");
+    }
+}
+
+// Function run by each stage's thread. The source takes chunks from the
+// free queue, so at most the pool depth is in flight; the last stage
+// returns them there.
+void run_stage(int s) {
+    Stage &stage = stages[s];
+    bool last = s == num_stages - 1;
+    long num_chunks = ((long)SZ + pipeline_chunk - 1) / pipeline_chunk;
+    long next = 0;
+
+    while (true) {
+        int c;
+        if (s == 0) {
+            bool stop = pipeline_cancel || std::chrono::high_resolution_clock::now() > pipeline_deadline;
+            c = next < num_chunks && !stop ? chunk_queue_take(pipeline_free) : PIPELINE_END;
+        } else {
+            c = chunk_queue_take(*stage.in);
+        }
+        if (c == PIPELINE_END) {
+            if (!last) {
+                chunk_queue_put(*stage.out, PIPELINE_END);
+            }
+            return;
+        }
+
+        Chunk &chunk = pipeline_chunks[c];
+        long index = chunk.offset / pipeline_chunk;
+        if (s == 0) {
+            index = next++;
+            chunk.offset = index * pipeline_chunk;
+            chunk.count = (int)std::min<long>(pipeline_chunk, SZ - chunk.offset);
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        process_chunk(stage, chunk, index);
+        stage.busy_ms += std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start).count();
+
+        if (last) {
+            if (pipeline_completed == 0) {
+                pipeline_first_ms = std::chrono::duration<double, std::milli>(
+                                        std::chrono::high_resolution_clock::now() - pipeline_start).count();
+            }
+            pipeline_completed.store(chunk.offset + chunk.count, std::memory_order_release);
+            if (pipeline_on_chunk != NULL) {
+                pipeline_on_chunk(chunk.offset, chunk.count, chunk.out, pipeline_on_chunk_arg);
+            }
+        }
+        chunk_queue_put(last ? pipeline_free : *stage.out, c);
+    }
+}
+
+// Function to run a comma-separated list of stages over SZ elements in
+// chunks, one thread per stage, with depth chunks in flight
+void run_pipeline(const char *spec, int chunk, int depth) {
+    depth = depth > 0 ? std::min(depth, PIPELINE_QUEUE_CAPACITY) : 4;
+
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", spec);
+    for (char *s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+        add_stage(s);
+    }
+    if (num_stages == 0) {
+        printf("Empty pipeline\n");
+        exit(1);
+    }
+
+    // Without an explicit chunk size, device pipelines use the device's recommendation
+    pipeline_chunk = std::min(1 << 16, SZ);
+    for (int s = 0; s < num_stages && chunk <= 0; s++) {
+        if (stages[s].kind == STAGE_DEVICE) {
+            setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+            pipeline_chunk = std::min(recommended_config(kernel).chunk, SZ);
+            break;
+        }
+    }
+    if (chunk > 0) {
+        pipeline_chunk = std::min(chunk, SZ);
+    }
+    for (int s = 0; s < num_stages; s++) {
+        open_stage(stages[s], s == 0);
+        stages[s].in = s > 0 ? &pipeline_queues[s - 1] : NULL;
+        stages[s].out = &pipeline_queues[s];
+    }
+
+    // Pool of depth chunks, all free to start with
+    int *pool = (int *)host_malloc(3 * (size_t)depth * pipeline_chunk * sizeof(int));
+    for (int c = 0; c < depth; c++) {
+        pipeline_chunks[c].a = pool + (size_t)3 * c * pipeline_chunk;
+        pipeline_chunks[c].b = pipeline_chunks[c].a + pipeline_chunk;
+        pipeline_chunks[c].out = pipeline_chunks[c].b + pipeline_chunk;
+        chunk_queue_put(pipeline_free, c);
+    }
+
+    pipeline_completed = 0;
+    pipeline_start = std::chrono::high_resolution_clock::now();
+    pipeline_deadline = std::chrono::high_resolution_clock::time_point::max();
+    const char *deadline = getenv("TASK_DEADLINE_MS");
+    if (deadline != NULL && atof(deadline) > 0) {
+        pipeline_deadline = pipeline_start + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                                                 std::chrono::duration<double, std::milli>(atof(deadline)));
+    }
+    signal(SIGINT, [](int) { pipeline_cancel = true; });
+    auto start = pipeline_start;
+    std::vector<std::thread> threads;
+    for (int s = 0; s < num_stages; s++) {
+        threads.push_back(std::thread(run_stage, s));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    free(pool);
+    for (int s = 0; s < num_stages; s++) {
+        print_summary(stages[s]);
+    }
+
+    printf("Pipeline %s: %d elements in chunks of %d, %d in flight, %f ms (%.1f M elements/s)\n", spec, SZ,
+           pipeline_chunk, depth, elapsed_ms, pipeline_completed / elapsed_ms / 1e3);
+    printf("First output chunk ready after %f ms\n", pipeline_first_ms);
+    if (pipeline_completed < SZ) {
+        printf("Stopped (%s) after %ld of %d elements\n", pipeline_cancel ? "cancelled" : "deadline passed",
+               (long)pipeline_completed, SZ);
+    }
+    printf("%-8s %12s %6s\n", "stage", "busy ms", "busy");
+    long mismatches = 0;
+    for (int s = 0; s < num_stages; s++) {
+        // Tell followers no more output is coming
+        cl_ulong stopped = 1;
+        if (stages[s].index_fd >= 0 && pipeline_completed < SZ &&
+            pwrite(stages[s].index_fd, &stopped, sizeof(stopped), offsetof(CompletionIndex, stopped)) < 0) {
+            perror("Couldn't write the completion index");
+            exit(1);
+        }
+        printf("%-8s %12.3f %5.1f%%\n", stage_names[stages[s].kind], stages[s].busy_ms,
+               100 * stages[s].busy_ms / elapsed_ms);
+        mismatches += stages[s].mismatches;
+        close_stage(stages[s]);
+    }
+    for (int s = 0; s < num_stages; s++) {
+        if (stages[s].kind == STAGE_VERIFY) {
+            printf("Verify: %ld mismatches\n", mismatches);
+            break;
+        }
+    }
+
+    if (context != NULL) {
+        free_memory();
+    }
+}
+
+// Function to consume a pipeline's file output while it is being written:
+// each range is read as soon as <path>.idx says it is complete
+void run_follow(const char *path) {
+    char index_path[300];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // The writer may not have started yet
+    int index_fd, data_fd;
+    while ((index_fd = open(index_path, O_RDONLY)) < 0 || (data_fd = open(path, O_RDONLY)) < 0) {
+        if (index_fd >= 0) {
+            close(index_fd);
+        }
+        usleep(1000);
+    }
+    int watch = inotify_init1(IN_NONBLOCK);
+    inotify_add_watch(watch, index_path, IN_MODIFY);
+    struct pollfd pfd = {watch, POLLIN, 0};
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    CompletionIndex index = {0, 0, 0};
+    cl_ulong consumed = 0;
+    long long sum = 0;
+    int ranges = 0;
+    double first_ms = -1;
+    std::vector<int> buffer;
+    while (true) {
+        if (pread(index_fd, &index, sizeof(index), 0) == sizeof(index) && index.completed > consumed) {
+            cl_ulong n = index.completed - consumed;
+            buffer.resize(n);
+            if (pread(data_fd, buffer.data(), n * sizeof(int), consumed * sizeof(int)) != (ssize_t)(n * sizeof(int))) {
+                perror("Couldn't read the pipeline output");
+                exit(1);
+            }
+            for (cl_ulong i = 0; i < n; i++) {
+                sum += buffer[i];
+            }
+            if (first_ms < 0) {
+                first_ms = std::chrono::duration<double, std::milli>(
+                               std::chrono::high_resolution_clock::now() - start).count();
+            }
+            consumed = index.completed;
+            ranges++;
+        }
+        if ((index.total > 0 && consumed == index.total) || (index.stopped && consumed == index.completed)) {
+            break;
+        }
+        // Wait for the writer to advance the index
+        if (poll(&pfd, 1, 100) > 0) {
+            while (read(watch, events, sizeof(events)) > 0) {
+            }
+        }
+    }
+    double total_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    close(watch);
+    close(index_fd);
+    close(data_fd);
+
+    printf("Followed %s: %llu elements in %d ranges, first after %f ms, all after %f ms, sum %lld\n", path,
+           (unsigned long long)consumed, ranges, first_ms, total_ms, sum);
+    if (consumed < index.total) {
+        printf("Partial output: the pipeline stopped after %llu of %llu elements\n", (unsigned long long)consumed,
+               (unsigned long long)index.total);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Memory budgets
+// ---------------------------------------------------------------------------
+
+// Function to read one number from a file; ULLONG_MAX if it is missing or "max"
+unsigned long long read_limit(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return ULLONG_MAX;
+    }
+    unsigned long long value = ULLONG_MAX;
+    if (fscanf(f, "%llu", &value) != 1) {
+        value = ULLONG_MAX;
+    }
+    fclose(f);
+    return value;
+}
+
+// Function to find this process's cgroup: the cgroup v2 path ("0::/path")
+// when the unified hierarchy is mounted, else the v1 memory controller's.
+// Returns whether it is a v2 path.
+bool self_cgroup(char *cgroup, size_t size) {
+    cgroup[0] = '\0';
+    bool v2 = false;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f != NULL) {
+        char line[600];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strncmp(line, "0::", 3) == 0 && !v2) {
+                snprintf(cgroup, size, "%s", line + 3);
+                v2 = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0;
+            } else if (strstr(line, ":memory:") != NULL && !v2) {
+                snprintf(cgroup, size, "%s", strstr(line, ":memory:") + 8);
+            }
+        }
+        fclose(f);
+    }
+    return v2;
+}
+
+// Function to find the host memory this process may still use: the
+// tightest cgroup limit on the way up from its cgroup minus what the cgroup
+// already uses, or MemAvailable when there is less. TASK_MEMORY_LIMIT
+// (bytes) overrides it.
+cl_ulong host_memory_available() {
+    const char *limit = getenv("TASK_MEMORY_LIMIT");
+    if (limit != NULL) {
+        return strtoull(limit, NULL, 10);
+    }
+
+    unsigned long long available = ULLONG_MAX;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f != NULL) {
+        char line[256];
+        unsigned long long kb;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+                available = kb * 1024;
+            }
+        }
+        fclose(f);
+    }
+
+    char cgroup[512];
+    bool v2 = self_cgroup(cgroup, sizeof(cgroup));
+
+    char path[700];
+    while (true) {
+        unsigned long long max, current;
+        if (v2) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cgroup);
+            max = read_limit(path);
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.current", cgroup);
+            current = read_limit(path);
+        } else {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", cgroup);
+            max = read_limit(path);
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.usage_in_bytes", cgroup);
+            current = read_limit(path);
+        }
+        if (max != ULLONG_MAX && current != ULLONG_MAX) {
+            available = std::min(available, max > current ? max - current : 0);
+        }
+
+        char *slash = strrchr(cgroup, '/');
+        if (slash == NULL || cgroup[0] == '\0' || strcmp(cgroup, "/") == 0) {
+            break;
+        }
+        *slash = '\0';
+        if (cgroup[0] == '\0') {
+            strcpy(cgroup, "/");
+        }
+    }
+    return available;
+}
+
+// Function to pick the elements processed at once so three vectors fit the
+// host and device budgets; SZ means everything fits in memory, 0 that not
+// even a MIN_STREAM_CHUNK chunk fits
+int plan_chunk(cl_ulong host_available, cl_ulong global_mem, cl_ulong max_alloc) {
+    cl_ulong host_budget = (cl_ulong)(host_available * MEMORY_FRACTION);
+    cl_ulong device_budget = (cl_ulong)(global_mem * MEMORY_FRACTION);
+    cl_ulong need = 3 * (cl_ulong)SZ * sizeof(int);
+    if (need <= host_budget && need <= device_budget && SZ * sizeof(int) <= max_alloc) {
+        return SZ;
+    }
+
+    // Streaming keeps STREAM_DEPTH chunks of three vectors on the host and
+    // one chunk of three buffers on the device
+    cl_ulong chunk = host_budget / (STREAM_DEPTH * 3 * sizeof(int));
+    chunk = std::min(chunk, device_budget / (3 * sizeof(int)));
+    chunk = std::min(chunk, max_alloc / sizeof(int));
+    chunk = std::min(chunk, (cl_ulong)SZ);
+    return chunk < MIN_STREAM_CHUNK ? 0 : (int)chunk;
+}
+
+// Function to report peak RSS and the device allocation high-water mark
+void report_memory() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS: %.1f MB, device allocations peak: %.1f MB\n", usage.ru_maxrss / 1024.0,
+           device_bytes_peak / (1024.0 * 1024.0));
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark environment and noise control
+// ---------------------------------------------------------------------------
+
+#define BENCH_REPS 10        // Timed runs of bench mode, after one warm-up run
+#define BENCH_MAX_CV 5.0     // Coefficient of variation (%) above which a result is noisy
+
+bool pin_threads = false;  // Pin host worker threads to separate CPUs (TASK_PIN or bench mode)
+
+// Settings that make timings noisy or hard to compare, recorded with results
+struct BenchEnvironment {
+    char cpu_model[128];
+    char kernel[3 * 65 + 3];  // uname sysname, release and machine, space-separated
+    char governor[32];
+    int turbo;  // 1 on, 0 off, -1 unknown
+    int smt;    // 1 active, 0 inactive, -1 unknown
+    int cpus;   // CPUs in the affinity mask
+    char cgroup_cpu[64];
+    char cgroup_memory[32];
+    char platform[128];
+    char device[128];
+    char driver[64];
+};
+
+// Function to pin the calling thread to the slot-th CPU it may run on;
+// returns the CPU, or -1 if it can't be pinned
+int pin_current_thread(int slot) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return -1;
+    }
+    slot %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && slot-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            return sched_setaffinity(0, sizeof(one), &one) == 0 ? cpu : -1;
+        }
+    }
+    return -1;
+}
+
+// Function to read the first line of a file without its newline; "" if it can't be read
+void read_line(const char *path, char *out, size_t size) {
+    out[0] = '\0';
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    if (fgets(out, size, f) != NULL) {
+        out[strcspn(out, "\n")] = '\0';
+    }
+    fclose(f);
+}
+
+// Function to collect the CPU, kernel, frequency scaling, SMT and cgroup
+// state, and with device set, the OpenCL platform, device and driver
+BenchEnvironment capture_environment(bool device) {
+    BenchEnvironment env;
+    memset(&env, 0, sizeof(env));
+
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f != NULL) {
+        char line[256];
+        while (env.cpu_model[0] == '\0' && fgets(line, sizeof(line), f) != NULL) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+                snprintf(env.cpu_model, sizeof(env.cpu_model), "%s", colon + 2);
+                env.cpu_model[strcspn(env.cpu_model, "\n")] = '\0';
+            }
+        }
+        fclose(f);
+    }
+
+    struct utsname uts;
+    if (uname(&uts) == 0) {
+        snprintf(env.kernel, sizeof(env.kernel), "%s %s %s", uts.sysname, uts.release, uts.machine);
+    }
+
+    read_line("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", env.governor, sizeof(env.governor));
+    char value[32];
+    env.turbo = -1;
+    read_line("/sys/devices/system/cpu/intel_pstate/no_turbo", value, sizeof(value));
+    if (value[0] != '\0') {
+        env.turbo = value[0] == '0';
+    } else {
+        read_line("/sys/devices/system/cpu/cpufreq/boost", value, sizeof(value));
+        env.turbo = value[0] != '\0' ? value[0] == '1' : -1;
+    }
+    read_line("/sys/devices/system/cpu/smt/active", value, sizeof(value));
+    env.smt = value[0] != '\0' ? value[0] == '1' : -1;
+
+    cpu_set_t allowed;
+    env.cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 0;
+
+    char cgroup[512], path[700];
+    if (self_cgroup(cgroup, sizeof(cgroup))) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup);
+        read_line(path, env.cgroup_cpu, sizeof(env.cgroup_cpu));
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cgroup);
+        read_line(path, env.cgroup_memory, sizeof(env.cgroup_memory));
+    } else {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes", cgroup);
+        read_line(path, env.cgroup_memory, sizeof(env.cgroup_memory));
+        if (strtoull(env.cgroup_memory, NULL, 10) >= (1ULL << 62)) {
+            strcpy(env.cgroup_memory, "max");  // v1 reports no limit as a huge page-aligned number
+        }
+    }
+
+    if (device) {
+        cl_device_id dev = create_device();
+        cl_platform_id platform;
+        char name[64] = "", version[64] = "";
+        clGetDeviceInfo(dev, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+        clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(name), name, NULL);
+        clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(version), version, NULL);
+        snprintf(env.platform, sizeof(env.platform), "%s (%s)", name, version);
+        clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(env.device), env.device, NULL);
+        clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(env.driver), env.driver, NULL);
+    }
+    return env;
+}
+
+// Function to print the environment and warn about settings that add noise
+void print_environment(const BenchEnvironment &env) {
+    const char *states[] = {"unknown", "off", "on"};
+    printf("cpu: %s, %d usable CPUs\n", env.cpu_model[0] ? env.cpu_model : "unknown", env.cpus);
+    printf("kernel: %s\n", env.kernel);
+    printf("governor: %s, turbo: %s, smt: %s\n", env.governor[0] ? env.governor : "unknown", states[env.turbo + 1],
+           states[env.smt + 1]);
+    printf("cgroup cpu.max: %s, memory limit: %s\n", env.cgroup_cpu[0] ? env.cgroup_cpu : "none",
+           env.cgroup_memory[0] ? env.cgroup_memory : "none");
+    if (env.platform[0] != '\0') {
+        printf("platform: %s, device: %s, driver: %s\n", env.platform, env.device, env.driver);
+    }
+
+    if (env.governor[0] != '\0' && strcmp(env.governor, "performance") != 0) {
+        printf("WARNING: the %s governor changes the CPU frequency during runs\n", env.governor);
+    }
+    if (env.turbo == 1) {
+        printf("WARNING: turbo boost is on; clocks depend on temperature and load\n");
+    }
+    if (env.smt == 1) {
+        printf("WARNING: SMT is active; sibling threads share a core\n");
+    }
+}
+
+// Function to sort samples and return their mean, standard deviation,
+// coefficient of variation (%), minimum and median
+void bench_stats(double *samples, int n, double *mean, double *stddev, double *cv, double *min, double *median) {
+    std::sort(samples, samples + n);
+    double sum = 0, squares = 0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    *mean = sum / n;
+    for (int i = 0; i < n; i++) {
+        squares += (samples[i] - *mean) * (samples[i] - *mean);
+    }
+    *stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+    *cv = *mean > 0 ? 100.0 * *stddev / *mean : 0;
+    *min = samples[0];
+    *median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+// Function to time the vector add reps times after a warm-up run, pinned to
+// one CPU, and report the spread with the environment it ran in. A
+// coefficient of variation above TASK_BENCH_MAX_CV (%) is a warning, or an
+// error when TASK_BENCH_STRICT is set. TASK_BENCH_OUT appends the result and
+// environment as one line to a file.
+void run_bench(int reps, const char *backend) {
+    bool device = strcmp(backend, "host") != 0;
+    reps = reps > 0 ? reps : BENCH_REPS;
+    const char *max_cv_env = getenv("TASK_BENCH_MAX_CV");
+    double max_cv = max_cv_env != NULL ? atof(max_cv_env) : BENCH_MAX_CV;
+
+    pin_threads = true;
+    int cpu = pin_current_thread(0);
+    BenchEnvironment env = capture_environment(device);
+    print_environment(env);
+    printf("pinned to CPU %d\n", cpu);
+
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    if (device) {
+        setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+        setup_kernel_memory();
+        copy_kernel_args();
+    }
+
+    double *samples = (double *)host_malloc(reps * sizeof(double));
+    size_t global[1] = {(size_t)SZ};
+    for (int r = -1; r < reps; r++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        if (device) {
+            clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 0, NULL, NULL);
+            clFinish(queue);
+        } else {
+            vector_add_host(v1, v2, v_out, SZ);
+        }
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+        if (r >= 0) {
+            samples[r] = elapsed_time.count();  // Run -1 is the warm-up
+        }
+    }
+
+    double mean, stddev, cv, min, median;
+    bench_stats(samples, reps, &mean, &stddev, &cv, &min, &median);
+    printf("%s add, SZ = %d, %d runs: mean %.3f ms, stddev %.3f ms, cv %.2f%%, min %.3f ms, median %.3f ms\n",
+           device ? "device" : "host", SZ, reps, mean, stddev, cv, min, median);
+
+    const char *out = getenv("TASK_BENCH_OUT");
+    if (out != NULL) {
+        FILE *f = fopen(out, "a");
+        if (f == NULL) {
+            perror("Couldn't open the benchmark output file");
+            exit(1);
+        }
+        fprintf(f, "backend=%s sz=%d reps=%d mean_ms=%.6f stddev_ms=%.6f cv=%.3f min_ms=%.6f median_ms=%.6f "
+                   "cpu_model=\"%s\" cpus=%d cpu=%d kernel=\"%s\" governor=%s turbo=%d smt=%d cgroup_cpu=\"%s\" "
+                   "cgroup_memory=%s platform=\"%s\" device=\"%s\" driver=\"%s\"\n",
+                backend, SZ, reps, mean, stddev, cv, min, median, env.cpu_model, env.cpus, cpu, env.kernel,
+                env.governor, env.turbo, env.smt, env.cgroup_cpu, env.cgroup_memory, env.platform, env.device,
+                env.driver);
+        fclose(f);
+    }
+
+    free(samples);
+    if (device) {
+        free_memory();
+    } else {
+        free(v1);
+        free(v2);
+        free(v_out);
+    }
+    if (cv > max_cv) {
+        printf("%s: cv %.2f%% is above %.2f%%; the runs are too noisy to compare\n",
+               getenv("TASK_BENCH_STRICT") != NULL ? "ERROR" : "WARNING", cv, max_cv);
+        if (getenv("TASK_BENCH_STRICT") != NULL) {
+            exit(1);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Single-source element-wise ops
+// ---------------------------------------------------------------------------
+
+// OpenCL source for every op in ELEMENTWISE_OPS, assembled at compile time
+#define ELEMENTWISE_KERNEL(name, expr) \
+    "__kernel void op_" #name "(const int size, __global const int *A, __global const int *B, __global int *C) {\n" \
+    "    int i = get_global_id(0);\n" \
+    "    if (i < size) {\n" \
+    "        int a = A[i];\n" \
+    "        int b = B[i];\n" \
+    "        C[i] = " #expr ";\n" \
+    "    }\n" \
+    "}\n"
+const char elementwise_source[] = ELEMENTWISE_OPS(ELEMENTWISE_KERNEL);
+#undef ELEMENTWISE_KERNEL
+
+// Operand type for the host loops: arithmetic wraps in uint32_t as OpenCL's
+// int does on overflow, where C++'s int would be undefined; comparisons stay signed
+struct WrapInt {
+    int v;
+};
+inline WrapInt operator+(WrapInt a, WrapInt b) { return {(int)((uint32_t)a.v + (uint32_t)b.v)}; }
+inline WrapInt operator-(WrapInt a, WrapInt b) { return {(int)((uint32_t)a.v - (uint32_t)b.v)}; }
+inline WrapInt operator*(WrapInt a, WrapInt b) { return {(int)((uint32_t)a.v * (uint32_t)b.v)}; }
+inline bool operator<(WrapInt a, WrapInt b) { return a.v < b.v; }
+inline bool operator>(WrapInt a, WrapInt b) { return a.v > b.v; }
+
+// Host loops for the same ops; the restrict pointers let the compiler
+// vectorize them with the host's SIMD instructions
+#define ELEMENTWISE_HOST(name, expr) \
+    void name##_host(const int *A, const int *B, int *C, int size) { \
+        const int *__restrict x = A; \
+        const int *__restrict y = B; \
+        int *__restrict z = C; \
+        for (long i = 0; i < size; i++) { \
+            WrapInt a = {x[i]}; \
+            WrapInt b = {y[i]}; \
+            z[i] = (expr).v; \
+        } \
+    }
+ELEMENTWISE_OPS(ELEMENTWISE_HOST)
+#undef ELEMENTWISE_HOST
+
+struct ElementwiseOp {
+    const char *name;
+    const char *expr;
+    void (*host)(const int *a, const int *b, int *c, int size);
+};
+
+#define ELEMENTWISE_ENTRY(name, expr) {#name, #expr, name##_host},
+ElementwiseOp elementwise_ops[] = {ELEMENTWISE_OPS(ELEMENTWISE_ENTRY)};
+#undef ELEMENTWISE_ENTRY
+const int num_elementwise_ops = sizeof(elementwise_ops) / sizeof(elementwise_ops[0]);
+
+// Function to run every element-wise op on the device and on the host and
+// check that they agree. The first elements are pairs that overflow, so the
+// host's wrapping is checked against the device's too.
+void run_ops() {
+    setup_openCL_device_context_queue_kernel(ELEMENTWISE_SOURCE_NAME, "op_add");
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    const int overflow[][2] = {{INT_MAX, 1}, {INT_MIN, 1}, {INT_MAX, INT_MAX}, {INT_MIN, INT_MAX}, {INT_MIN, -1}};
+    for (int i = 0; i < 5 && i < SZ; i++) {
+        v1[i] = overflow[i][0];
+        v2[i] = overflow[i][1];
+    }
+    int *expected = (int *)host_malloc(SZ * sizeof(int));
+    setup_kernel_memory();
+
+    size_t global[1] = {(size_t)SZ};
+    printf("%-8s %-28s %12s %12s %11s\n", "op", "expression", "device ms", "host ms", "mismatches");
+    bool failed = false;
+    for (int o = 0; o < num_elementwise_ops; o++) {
+        const ElementwiseOp &op = elementwise_ops[o];
+        char name[64];
+        snprintf(name, sizeof(name), "op_%s", op.name);
+        cl_kernel k = create_kernel(program, name);
+        err = clSetKernelArg(k, 0, sizeof(int), (void *)&SZ);
+        err |= clSetKernelArg(k, 1, sizeof(cl_mem), (void *)&bufV1);
+        err |= clSetKernelArg(k, 2, sizeof(cl_mem), (void *)&bufV2);
+        err |= clSetKernelArg(k, 3, sizeof(cl_mem), (void *)&bufV_out);
+        check_error(err, "Couldn't create a kernel argument");
+
+        auto start = std::chrono::high_resolution_clock::now();
+        clEnqueueNDRangeKernel(queue, k, 1, NULL, global, NULL, 0, NULL, NULL);
+        clEnqueueReadBuffer(queue, bufV_out, CL_TRUE, 0, SZ * sizeof(int), v_out, 0, NULL, NULL);
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> device_time = stop - start;
+
+        start = std::chrono::high_resolution_clock::now();
+        op.host(v1, v2, expected, SZ);
+        stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> host_time = stop - start;
+
+        long mismatches = 0;
+        for (long i = 0; i < SZ; i++) {
+            mismatches += (v_out[i] != expected[i]);
+        }
+        failed |= mismatches > 0;
+        printf("%-8s %-28s %12.3f %12.3f %11ld\n", op.name, op.expr, device_time.count(), host_time.count(),
+               mismatches);
+        clReleaseKernel(k);
+    }
+
+    free(expected);
+    free_memory();
+    if (failed) {
+        printf("FAILED: device and host results differ\n");
+        exit(1);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Queue pool for concurrent small kernels
+// ---------------------------------------------------------------------------
+
+#define QUEUE_POOL_MAX 16         // Queues per device at most
+#define QUEUE_BENCH_JOBS 4096     // Vector adds per benchmark run
+#define QUEUE_BENCH_MAX_SIZE (1 << 20)  // Elements per job at most
+
+// In-order queues on one device, with the jobs each has in flight. The
+// queues benchmark uses queue_pool; each libvecops engine has its own.
+struct QueuePool {
+    cl_command_queue queues[QUEUE_POOL_MAX];
+    std::atomic<int> pending[QUEUE_POOL_MAX];
+    int size;
+    bool load_aware;  // Least pending jobs rather than round-robin
+    std::atomic<unsigned> next;
+};
+QueuePool queue_pool;
+
+// Function to create n queues on a context and device. TASK_QUEUES sets the
+// size when n is 0. Returns the first error, after releasing what was made.
+cl_int setup_queue_pool(QueuePool &pool, cl_context ctx, cl_device_id dev, int n, bool load_aware) {
+    const char *queues_env = getenv("TASK_QUEUES");
+    if (n <= 0) {
+        n = queues_env != NULL ? atoi(queues_env) : 4;
+    }
+    cl_int status = CL_SUCCESS;
+    pool.size = 0;
+    pool.load_aware = load_aware;
+    pool.next = 0;
+    for (int q = 0; q < std::max(1, std::min(n, QUEUE_POOL_MAX)); q++) {
+        pool.queues[q] = clCreateCommandQueueWithProperties(ctx, dev, 0, &status);
+        if (status < 0) {
+            free_queue_pool(pool);
+            return status;
+        }
+        pool.pending[q] = 0;
+        pool.size++;
+    }
+    return status;
+}
+
+// Function to release the pool's queues
+void free_queue_pool(QueuePool &pool) {
+    for (int q = 0; q < pool.size; q++) {
+        clReleaseCommandQueue(pool.queues[q]);
+    }
+    pool.size = 0;
+}
+
+// Function to pick a queue for a job and count it as in flight there; its
+// index goes to *q. Pair with release_queue() or release_queue_on_completion().
+cl_command_queue acquire_queue(QueuePool &pool, int *q) {
+    int best = pool.next++ % pool.size;
+    if (pool.load_aware) {
+        // Start the scan at the round-robin pick so ties still spread out
+        for (int i = 1; i < pool.size; i++) {
+            int candidate = (best + i) % pool.size;
+            if (pool.pending[candidate] < pool.pending[best]) {
+                best = candidate;
+            }
+        }
+    }
+    pool.pending[best]++;
+    *q = best;
+    return pool.queues[best];
+}
+
+// Function to mark a job on queue q as done
+void release_queue(QueuePool &pool, int q) {
+    pool.pending[q]--;
+}
+
+// Function to count a job down from the completion callback of its last command
+void CL_CALLBACK release_queue_callback(cl_event, cl_int, void *pending) {
+    (*(std::atomic<int> *)pending)--;
+}
+
+// Function to mark a job on queue q as done once last, its final command,
+// completes, for callers that don't wait for their jobs themselves
+cl_int release_queue_on_completion(QueuePool &pool, int q, cl_event last) {
+    return clSetEventCallback(last, CL_COMPLETE, release_queue_callback, &pool.pending[q]);
+}
+
+// Function to run jobs vector adds of SZ elements from clients threads, each
+// with its own kernel and buffers, on queues taken from the pool. Returns
+// the wall time in ms; mismatches in the clients' last outputs are added to
+// *mismatches.
+double time_queue_pool(int clients, int jobs, long *mismatches) {
+    std::atomic<int> next_job(0);
+    std::atomic<long> bad(0);
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int c = 0; c < clients; c++) {
+        workers.push_back(std::thread([&] {
+            cl_int status;
+            cl_kernel k = create_kernel(program, "vector_add_ocl");
+            cl_mem bufs[3];
+            for (int b = 0; b < 3; b++) {
+                bufs[b] = clCreateBuffer(context, CL_MEM_READ_WRITE, SZ * sizeof(int), NULL, &status);
+                check_error(status, "Couldn't create a buffer");
+            }
+            status = clSetKernelArg(k, 0, sizeof(int), (void *)&SZ);
+            for (int b = 0; b < 3; b++) {
+                status |= clSetKernelArg(k, b + 1, sizeof(cl_mem), (void *)&bufs[b]);
+            }
+            check_error(status, "Couldn't create a kernel argument");
+
+            int *out = (int *)host_malloc(SZ * sizeof(int));
+            size_t global[1] = {(size_t)SZ};
+            while (next_job++ < jobs) {
+                int q;
+                cl_command_queue cq = acquire_queue(queue_pool, &q);
+                clEnqueueWriteBuffer(cq, bufs[0], CL_FALSE, 0, SZ * sizeof(int), v1, 0, NULL, NULL);
+                clEnqueueWriteBuffer(cq, bufs[1], CL_FALSE, 0, SZ * sizeof(int), v2, 0, NULL, NULL);
+                clEnqueueNDRangeKernel(cq, k, 1, NULL, global, NULL, 0, NULL, NULL);
+                clEnqueueReadBuffer(cq, bufs[2], CL_TRUE, 0, SZ * sizeof(int), out, 0, NULL, NULL);
+                release_queue(queue_pool, q);
+            }
+
+            long wrong = 0;
+            for (long i = 0; i < SZ; i++) {
+                wrong += out[i] != v1[i] + v2[i];
+            }
+            bad += wrong;
+            free(out);
+            for (int b = 0; b < 3; b++) {
+                clReleaseMemObject(bufs[b]);
+            }
+            clReleaseKernel(k);
+        }));
+    }
+    for (size_t c = 0; c < workers.size(); c++) {
+        workers[c].join();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed_time = stop - start;
+    *mismatches += bad;
+    return elapsed_time.count();
+}
+
+// Function to compare the throughput of many small vector adds of SZ
+// elements through 1 queue and through a pool of n queues. The same two
+// client threads per pool queue submit them in both runs, so only the
+// number of queues changes.
+void run_queues(int n, const char *policy) {
+    bool load_aware = policy != NULL && strcmp(policy, "load") == 0;
+    if (SZ > QUEUE_BENCH_MAX_SIZE) {
+        printf("The queue benchmark runs small jobs; SZ must be at most %d\n", QUEUE_BENCH_MAX_SIZE);
+        exit(1);
+    }
+
+    init(v1, SZ);
+    init(v2, SZ);
+    init(v_out, SZ);
+    setup_openCL_device_context_queue_kernel("./vector_ops.txt", "vector_add_ocl");
+    err = setup_queue_pool(queue_pool, context, device_id, n, load_aware);
+    check_error(err, "Couldn't create a command queue");
+    int pool = queue_pool.size;
+    free_queue_pool(queue_pool);
+
+    printf("%d vector adds of %d elements, %s assignment\n", QUEUE_BENCH_JOBS, SZ,
+           load_aware ? "load-aware" : "round-robin");
+    printf("%8s %8s %12s %12s %10s\n", "queues", "clients", "ms", "jobs/s", "speedup");
+    int clients = 2 * pool;
+    long mismatches = 0;
+    double base = 0;
+    for (int queues : {1, pool}) {
+        err = setup_queue_pool(queue_pool, context, device_id, queues, load_aware);
+        check_error(err, "Couldn't create a command queue");
+        time_queue_pool(clients, clients, &mismatches);  // Warm-up
+        double ms = time_queue_pool(clients, QUEUE_BENCH_JOBS, &mismatches);
+        base = queues == 1 ? ms : base;
+        printf("%8d %8d %12.3f %12.0f %9.2fx\n", queues, clients, ms, QUEUE_BENCH_JOBS / (ms / 1000.0),
+               base / ms);
+        free_queue_pool(queue_pool);
+        if (pool == 1) {
+            break;
+        }
+    }
+    printf("Mismatches: %ld\n", mismatches);
+    free_memory();
+}
+
+// ---------------------------------------------------------------------------
+// libvecops: C ABI for embedding (built with -DVECOPS_LIBRARY, see vecops.h)
+// ---------------------------------------------------------------------------
+
+#ifdef VECOPS_LIBRARY
+
+struct vecops_engine {
+    bool host;  // VECOPS_ENGINE_HOST: jobs run on host threads
+    cl_context context;
+    QueuePool pool;  // Jobs run on the queue with the fewest in flight; imports and releases use the first
+    cl_program program;
+    cl_kernel kernels[num_elementwise_ops];  // op_<name>, in elementwise_ops order
+    std::mutex lock;                         // Serializes argument setting and enqueues
+    std::atomic<long long> submitted, completed, failed, elements, buffers_live, bytes_imported;
+    double busy_ms;  // Guarded by lock
+};
+
+struct vecops_buffer {
+    vecops_engine *engine;
+    cl_mem mem;    // NULL on a host engine
+    void *host;
+    size_t bytes;
+    void *mapped;  // Mapping that gives the host ownership; NULL while jobs use the buffer
+    cl_event mapped_event;  // Completion of that mapping, which may be on any of the engine's queues
+};
+
+struct vecops_job {
+    vecops_engine *engine;
+    size_t n;
+    std::chrono::high_resolution_clock::time_point start;
+    cl_event events[3];  // Maps of the job's buffers back to the host
+    int num_events;
+    int pooled;          // Pool queue vecops_finish() releases; -1 once the last map's callback will
+    std::thread worker;  // Host engine only
+};
+
+// Function to find an element-wise op by name; returns -1 if there is none
+int vecops_find_op(const char *op) {
+    for (int o = 0; op != NULL && o < num_elementwise_ops; o++) {
+        if (strcmp(elementwise_ops[o].name, op) == 0) {
+            return o;
+        }
+    }
+    return -1;
+}
+
+int vecops_abi_version(void) {
+    return VECOPS_ABI_VERSION;
+}
+
+// Function to create an engine. Unlike create_device() and get_program(),
+// every failure is returned to the caller instead of exiting.
+vecops_engine *vecops_engine_create(int flags) {
+    vecops_engine *engine = new (std::nothrow) vecops_engine();
+    if (engine == NULL) {
+        return NULL;
+    }
+    engine->host = (flags & VECOPS_ENGINE_HOST) != 0;
+    if (engine->host) {
+        return engine;
+    }
+    if (!load_opencl()) {
+        delete engine;
+        return NULL;
+    }
+
+    cl_platform_id platform;
+    cl_device_id dev;
+    cl_int err = clGetPlatformIDs(1, &platform, NULL);
+    if (err >= 0) {
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
+        if (err == CL_DEVICE_NOT_FOUND) {
+            err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 1, &dev, NULL);
+        }
+    }
+    if (err >= 0) {
+        engine->context = clCreateContext(NULL, 1, &dev, NULL, NULL, &err);
+    }
+    if (err >= 0) {
+        err = setup_queue_pool(engine->pool, engine->context, dev, 0, true);
+    }
+    if (err >= 0) {
+        const char *source = elementwise_source;
+        size_t length = strlen(elementwise_source);
+        engine->program = clCreateProgramWithSource(engine->context, 1, &source, &length, &err);
+    }
+    if (err >= 0) {
+        err = clBuildProgram(engine->program, 0, NULL, NULL, NULL, NULL);
+    }
+    for (int o = 0; err >= 0 && o < num_elementwise_ops; o++) {
+        char name[64];
+        snprintf(name, sizeof(name), "op_%s", elementwise_ops[o].name);
+        engine->kernels[o] = clCreateKernel(engine->program, name, &err);
+    }
+    if (err < 0) {
+        vecops_engine_destroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void vecops_engine_destroy(vecops_engine *engine) {
+    if (engine == NULL) {
+        return;
+    }
+    // Completion callbacks may still run after clFinish() returns
+    for (int q = 0; q < engine->pool.size; q++) {
+        clFinish(engine->pool.queues[q]);
+        while (engine->pool.pending[q] > 0) {
+            std::this_thread::yield();
+        }
+    }
+    for (int o = 0; o < num_elementwise_ops; o++) {
+        if (engine->kernels[o] != NULL) {
+            clReleaseKernel(engine->kernels[o]);
+        }
+    }
+    if (engine->program != NULL) {
+        clReleaseProgram(engine->program);
+    }
+    free_queue_pool(engine->pool);
+    if (engine->context != NULL) {
+        clReleaseContext(engine->context);
+    }
+    delete engine;
+}
+
+// Function to wrap caller memory in a buffer. On a device engine the buffer
+// stays mapped, i.e. owned by the host, except while jobs use it.
+vecops_buffer *vecops_buffer_import(vecops_engine *engine, void *host, size_t bytes) {
+    if (engine == NULL || host == NULL || bytes == 0) {
+        return NULL;
+    }
+    vecops_buffer *buffer = new (std::nothrow) vecops_buffer();
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->engine = engine;
+    buffer->host = host;
+    buffer->bytes = bytes;
+
+    if (!engine->host) {
+        cl_int err;
+        buffer->mem = clCreateBuffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, bytes, host, &err);
+        if (err >= 0) {
+            std::lock_guard<std::mutex> guard(engine->lock);
+            buffer->mapped = clEnqueueMapBuffer(engine->pool.queues[0], buffer->mem, CL_TRUE,
+                                                CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &err);
+        }
+        if (err < 0) {
+            if (buffer->mem != NULL) {
+                clReleaseMemObject(buffer->mem);
+            }
+            delete buffer;
+            return NULL;
+        }
+    }
+    engine->buffers_live++;
+    engine->bytes_imported += bytes;
+    return buffer;
+}
+
+void vecops_buffer_release(vecops_buffer *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    vecops_engine *engine = buffer->engine;
+    if (buffer->mem != NULL) {
+        std::lock_guard<std::mutex> guard(engine->lock);
+        cl_event wait = buffer->mapped_event;
+        if (buffer->mapped != NULL) {
+            clEnqueueUnmapMemObject(engine->pool.queues[0], buffer->mem, buffer->mapped, wait != NULL ? 1 : 0,
+                                    wait != NULL ? &wait : NULL, NULL);
+        }
+        if (buffer->mapped_event != NULL) {
+            clReleaseEvent(buffer->mapped_event);
+        }
+        clReleaseMemObject(buffer->mem);
+    }
+    engine->buffers_live--;
+    engine->bytes_imported -= buffer->bytes;
+    delete buffer;
+}
+
+vecops_job *vecops_submit(vecops_engine *engine, const char *op, vecops_buffer *a, vecops_buffer *b,
+                          vecops_buffer *out, size_t n, int *error) {
+    int o = vecops_find_op(op);
+    int status = VECOPS_OK;
+    if (engine == NULL || a == NULL || b == NULL || out == NULL || n > INT_MAX) {
+        status = VECOPS_EINVAL;
+    } else if (o < 0) {
+        status = VECOPS_ENOOP;
+    } else if (a->engine != engine || b->engine != engine || out->engine != engine ||
+               n * sizeof(int) > a->bytes || n * sizeof(int) > b->bytes || n * sizeof(int) > out->bytes) {
+        status = VECOPS_EINVAL;
+    }
+    vecops_job *job = status == VECOPS_OK ? new (std::nothrow) vecops_job() : NULL;
+    if (status == VECOPS_OK && job == NULL) {
+        status = VECOPS_EINVAL;
+    }
+    if (status != VECOPS_OK) {
+        if (error != NULL) {
+            *error = status;
+        }
+        return NULL;
+    }
+    job->engine = engine;
+    job->n = n;
+    job->start = std::chrono::high_resolution_clock::now();
+
+    if (engine->host) {
+        void (*host)(const int *, const int *, int *, int) = elementwise_ops[o].host;
+        job->pooled = -1;
+        job->worker = std::thread([=] { host((const int *)a->host, (const int *)b->host, (int *)out->host, (int)n); });
+        engine->submitted++;
+        return job;
+    }
+
+    // Hand the buffers to the device, run the kernel, then queue the maps
+    // that return them to the host; a, b and out may be the same buffer
+    vecops_buffer *buffers[3];
+    int count = 0;
+    for (vecops_buffer *buffer : {a, b, out}) {
+        if (std::find(buffers, buffers + count, buffer) == buffers + count) {
+            buffers[count++] = buffer;
+        }
+    }
+
+    cl_int err = 0;
+    int size = (int)n;
+    cl_kernel k = engine->kernels[o];
+    {
+        std::lock_guard<std::mutex> guard(engine->lock);
+        cl_command_queue q = acquire_queue(engine->pool, &job->pooled);
+
+        // A buffer's last map may be on another queue; taking it back waits for that
+        for (int i = 0; i < count; i++) {
+            if (buffers[i]->mapped != NULL) {
+                cl_event wait = buffers[i]->mapped_event;
+                err |= clEnqueueUnmapMemObject(q, buffers[i]->mem, buffers[i]->mapped, wait != NULL ? 1 : 0,
+                                               wait != NULL ? &wait : NULL, NULL);
+                buffers[i]->mapped = NULL;
+            }
+        }
+        err |= clSetKernelArg(k, 0, sizeof(int), &size);
+        err |= clSetKernelArg(k, 1, sizeof(cl_mem), &a->mem);
+        err |= clSetKernelArg(k, 2, sizeof(cl_mem), &b->mem);
+        err |= clSetKernelArg(k, 3, sizeof(cl_mem), &out->mem);
+        size_t global[1] = {n};
+        if (n > 0) {
+            err |= clEnqueueNDRangeKernel(q, k, 1, NULL, global, NULL, 0, NULL, NULL);
+        }
+        for (int i = 0; i < count; i++) {
+            cl_int map_err;
+            buffers[i]->mapped = clEnqueueMapBuffer(q, buffers[i]->mem, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0,
+                                                    buffers[i]->bytes, 0, NULL, &job->events[job->num_events],
+                                                    &map_err);
+            if (map_err >= 0) {
+                if (buffers[i]->mapped_event != NULL) {
+                    clReleaseEvent(buffers[i]->mapped_event);
+                }
+                buffers[i]->mapped_event = job->events[job->num_events++];
+                clRetainEvent(buffers[i]->mapped_event);
+            }
+            err |= map_err;
+        }
+
+        // The queue counts the job until its last map completes, whether or
+        // not the caller waits for it
+        if (err == 0 && release_queue_on_completion(engine->pool, job->pooled, job->events[count - 1]) >= 0) {
+            job->pooled = -1;
+        }
+    }
+    engine->submitted++;
+    if (err != 0) {
+        vecops_finish(job);
+        engine->failed++;
+        if (error != NULL) {
+            *error = VECOPS_EDEVICE;
+        }
+        return NULL;
+    }
+    return job;
+}
+
+// Function to wait until a job's work is done and free it; returns
+// VECOPS_OK or VECOPS_EDEVICE without counting the job in the stats
+int vecops_finish(vecops_job *job) {
+    int status = VECOPS_OK;
+    if (job->worker.joinable()) {
+        job->worker.join();
+    }
+    if (job->num_events > 0 && clWaitForEvents(job->num_events, job->events) < 0) {
+        status = VECOPS_EDEVICE;
+    }
+    for (int i = 0; i < job->num_events; i++) {
+        clReleaseEvent(job->events[i]);
+    }
+    if (job->pooled >= 0) {
+        release_queue(job->engine->pool, job->pooled);
+    }
+    delete job;
+    return status;
+}
+
+int vecops_wait(vecops_job *job) {
+    if (job == NULL) {
+        return VECOPS_EINVAL;
+    }
+    vecops_engine *engine = job->engine;
+    size_t n = job->n;
+    auto start = job->start;
+    int status = vecops_finish(job);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    if (status == VECOPS_OK) {
+        engine->completed++;
+        engine->elements += n;
+    } else {
+        engine->failed++;
+    }
+    std::lock_guard<std::mutex> guard(engine->lock);
+    engine->busy_ms += elapsed.count();
+    return status;
+}
+
+int vecops_stats_get(vecops_engine *engine, vecops_stats *stats) {
+    if (engine == NULL || stats == NULL || stats->size < VECOPS_STATS_SIZE_V1) {
+        return VECOPS_EINVAL;
+    }
+
+    // Only the fields that fit in the caller's version of the struct
+#define VECOPS_STATS_SET(field, value) \
+    if (stats->size >= offsetof(vecops_stats, field) + sizeof(stats->field)) { \
+        stats->field = value; \
+    }
+    VECOPS_STATS_SET(jobs_submitted, engine->submitted)
+    VECOPS_STATS_SET(jobs_completed, engine->completed)
+    VECOPS_STATS_SET(jobs_failed, engine->failed)
+    VECOPS_STATS_SET(elements, engine->elements)
+    VECOPS_STATS_SET(buffers_live, engine->buffers_live)
+    VECOPS_STATS_SET(bytes_imported, engine->bytes_imported)
+    std::lock_guard<std::mutex> guard(engine->lock);
+    VECOPS_STATS_SET(busy_ms, engine->busy_ms)
+#undef VECOPS_STATS_SET
+    return VECOPS_OK;
+}
+
+#endif // VECOPS_LIBRARY
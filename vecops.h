@@ -0,0 +1,92 @@
+/*
+ * vecops.h - C interface of libvecops.so, the vector ops of task.cpp built
+ * as a shared library (see README.md). Only the functions below are
+ * exported (vecops.map); their signatures and the layout of vecops_stats
+ * only change together with VECOPS_ABI_VERSION.
+ *
+ * Functions that can fail return NULL or a negative VECOPS_E* code; the
+ * library never exits the calling process. A missing or incomplete OpenCL
+ * library makes vecops_engine_create fail for device engines; host engines
+ * don't load it. An engine may be used from several threads.
+ */
+#ifndef VECOPS_H
+#define VECOPS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VECOPS_ABI_VERSION 1
+
+#if defined(__GNUC__)
+#define VECOPS_API __attribute__((visibility("default")))
+#else
+#define VECOPS_API
+#endif
+
+/* Return codes */
+#define VECOPS_OK 0
+#define VECOPS_EINVAL -1  /* Bad argument, e.g. a buffer too small for the job */
+#define VECOPS_ENOOP -2   /* No element-wise op of that name */
+#define VECOPS_EDEVICE -3 /* The OpenCL runtime reported an error */
+
+/* Engine flags */
+#define VECOPS_ENGINE_DEVICE 0 /* Run jobs on the first GPU, else CPU, OpenCL device */
+#define VECOPS_ENGINE_HOST 1   /* Run jobs on the host, without loading OpenCL */
+
+typedef struct vecops_engine vecops_engine;
+typedef struct vecops_buffer vecops_buffer;
+typedef struct vecops_job vecops_job;
+
+/* Counters of one engine. Set size to sizeof(vecops_stats) before calling
+ * vecops_stats_get; fields added in later versions are only written when
+ * the caller's struct is large enough to hold them, so callers built
+ * against an older vecops.h keep working. */
+typedef struct vecops_stats {
+    size_t size;
+    long long jobs_submitted;
+    long long jobs_completed;
+    long long jobs_failed;
+    long long elements;        /* Elements processed by completed jobs */
+    long long buffers_live;    /* Imported buffers not yet released */
+    long long bytes_imported;  /* Bytes of the live imported buffers */
+    double busy_ms;            /* Sum of submit-to-completion times */
+} vecops_stats;
+
+/* Smallest size vecops_stats_get accepts: the struct as of ABI version 1 */
+#define VECOPS_STATS_SIZE_V1 (offsetof(vecops_stats, busy_ms) + sizeof(double))
+
+VECOPS_API int vecops_abi_version(void);
+
+/* Engine: one OpenCL context, a pool of in-order queues (TASK_QUEUES, default
+ * 4) and the element-wise kernels. Each job runs on the queue with the fewest
+ * jobs in flight, so jobs submitted before earlier ones are waited for can
+ * run concurrently; jobs sharing a buffer still run in submission order. */
+VECOPS_API vecops_engine *vecops_engine_create(int flags);
+VECOPS_API void vecops_engine_destroy(vecops_engine *engine);
+
+/* Wraps bytes of caller memory without copying (CL_MEM_USE_HOST_PTR). The
+ * memory must outlive the buffer, and the caller may only touch it while no
+ * job using the buffer is in flight. */
+VECOPS_API vecops_buffer *vecops_buffer_import(vecops_engine *engine, void *host, size_t bytes);
+VECOPS_API void vecops_buffer_release(vecops_buffer *buffer);
+
+/* Queues out[i] = a[i] <op> b[i] for n ints and returns at once. op names an
+ * element-wise op ("add", "sub", "mul", "min", "max", "absdiff"). On error
+ * returns NULL and stores the code in *error when error is not NULL. */
+VECOPS_API vecops_job *vecops_submit(vecops_engine *engine, const char *op, vecops_buffer *a,
+                                     vecops_buffer *b, vecops_buffer *out, size_t n, int *error);
+
+/* Blocks until the job is done, frees it, and returns VECOPS_OK or an error.
+ * Afterwards the result is in the output buffer's host memory. */
+VECOPS_API int vecops_wait(vecops_job *job);
+
+VECOPS_API int vecops_stats_get(vecops_engine *engine, vecops_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VECOPS_H */